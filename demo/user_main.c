@@ -85,8 +85,8 @@ static shttpResponse *helloName(shttpRequest *request) {
     // but better safe than sorry
     if (request->numPathParameters == 1) {
 
-        // create greeting message
-        char *responseBuffer = malloc(BUF_SZ);
+        // create greeting message, the memory is released with the request
+        char *responseBuffer = shttp_request_alloc(request, BUF_SZ);
         int len = sprintf(
             responseBuffer,
             "Hello %s!",
@@ -97,7 +97,7 @@ static shttpResponse *helloName(shttpRequest *request) {
         printf("Param: %s\n", request->pathParameters[0]);
         
         // return plain text response
-        return shttp_text_response(shttpStatusOK, responseBuffer, true);
+        return shttp_text_response(shttpStatusOK, responseBuffer, false);
     } else {
         // no parameter, bad request, no treats for you!
         return BAD_REQUEST;
@@ -131,10 +131,10 @@ void user_init(void) {
 }
 
 void startup(void *userData) {
-    shttpConfig config;
+    shttpConfig config = { 0 };
 
     // set a hostname, if a request with a different host header
-    // arrives the server will automatically return 404
+    // arrives the server will automatically return 400
     config.hostName = "esp8266";
 
     // the port to use, default should be 80
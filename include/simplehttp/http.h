@@ -15,6 +15,12 @@
 #define SHTTP_PRIO 3
 #endif
 
+// Number of data processing tasks, every task gets its own stack of
+// SHTTP_STACK_SIZE, so be careful when raising this
+#ifndef SHTTP_WORKERS
+#define SHTTP_WORKERS 1
+#endif
+
 // Max HTTP recv buffer
 #ifndef SHTTP_MAX_RECV_BUFFER
 #define SHTTP_MAX_RECV_BUFFER 1500 /* default max MTU */
@@ -25,14 +31,117 @@
 #define SHTTP_MAX_BODY_SIZE 4096
 #endif
 
+// Max size of request line and headers, they are parsed in place in the
+// received buffers, which are kept until the request is finished
+#ifndef SHTTP_MAX_HEADER_SIZE
+#define SHTTP_MAX_HEADER_SIZE 2048
+#endif
+
+// Size of the memory block every connection allocates request data from,
+// parameter and header lists, path parameters and the body. The block is
+// reused for every request, more blocks are added if a request needs them
+#ifndef SHTTP_ARENA_SIZE
+#define SHTTP_ARENA_SIZE 512
+#endif
+
+// Max length of a header line of a multipart/form-data part, longer
+// lines are answered with 400
+#ifndef SHTTP_MULTIPART_LINE_SIZE
+#define SHTTP_MULTIPART_LINE_SIZE 200
+#endif
+
+// Max number of ports one server listens on, see shttp_listen_all()
+#ifndef SHTTP_MAX_LISTENERS
+#define SHTTP_MAX_LISTENERS 2
+#endif
+
+// Max number of fresh connections the accepting task holds back until
+// their request line arrives, to queue requests for PRIORITY routes ahead
+// of the others. If all slots are taken connections are queued right
+// away. Set to 0 to disable, needs LWIP_SO_RCVTIMEO.
+#ifndef SHTTP_MAX_PENDING_CONNECTIONS
+#define SHTTP_MAX_PENDING_CONNECTIONS 4
+#endif
+
+// Serve all connections from the task calling shttp_listen instead of
+// a pool of data processing tasks. Every connection then only costs a
+// parser state instead of a task stack, but routes run one at a time in
+// that task, so give it SHTTP_STACK_SIZE. Needs LWIP_SO_RCVTIMEO.
+#ifndef SHTTP_EVENT_ENGINE
+#define SHTTP_EVENT_ENGINE 0
+#endif
+
+// Max number of connections served at once by the event engine
+#ifndef SHTTP_MAX_CONNECTIONS
+#define SHTTP_MAX_CONNECTIONS 10
+#endif
+
 // simplehttp can accept multiple connections at once but only
-// processes them in incoming order, one at a time. This defined
-// how many connections may be queued before just dropping the
-// connection
+// processes as many of them as there are data processing tasks,
+// in incoming order. This defines how many connections may be
+// queued before just dropping the connection
 #ifndef SHTTP_MAX_QUEUED_CONNECTIONS
 #define SHTTP_MAX_QUEUED_CONNECTIONS 10
 #endif
 
+// If the connection queue is full new connections are answered with
+// a canned 503 response and closed instead of waiting for a free slot,
+// set to 0 to block the accepting task instead
+#ifndef SHTTP_LOAD_SHEDDING
+#define SHTTP_LOAD_SHEDDING 1
+#endif
+
+// With load shedding enabled, connections are also shed while the free
+// heap is below this many bytes
+#ifndef SHTTP_SHED_FREE_HEAP
+#define SHTTP_SHED_FREE_HEAP 4096
+#endif
+
+// Seconds a client is asked to wait before retrying a shed connection
+#ifndef SHTTP_RETRY_AFTER
+#define SHTTP_RETRY_AFTER 1
+#endif
+
+// Time in milliseconds an idle persistent connection is kept open
+// waiting for the next request
+#ifndef SHTTP_KEEPALIVE_TIMEOUT
+#define SHTTP_KEEPALIVE_TIMEOUT 5000
+#endif
+
+// Max number of requests served on one persistent connection before
+// it is closed, set to 1 to disable keep-alive
+#ifndef SHTTP_MAX_KEEPALIVE_REQUESTS
+#define SHTTP_MAX_KEEPALIVE_REQUESTS 100
+#endif
+
+// Time in milliseconds a client may take to send the request line and
+// headers, counted from the first byte of the request
+#ifndef SHTTP_HEADER_TIMEOUT
+#define SHTTP_HEADER_TIMEOUT 10000
+#endif
+
+// Time in milliseconds a client may take to send the request body,
+// counted from the end of the headers. Streamed bodies (see STREAM())
+// may take as long as they need, the timeout applies between two chunks
+#ifndef SHTTP_BODY_TIMEOUT
+#define SHTTP_BODY_TIMEOUT 30000
+#endif
+
+// Time in milliseconds a write to the client may make no progress before
+// the connection is dropped. Data processing tasks use it as the send
+// timeout of their connection with LWIP_SO_SNDTIMEO and poll without it
+#ifndef SHTTP_WRITE_TIMEOUT
+#define SHTTP_WRITE_TIMEOUT 10000
+#endif
+
+// Bodies that fit into one buffer of this many bytes together with the
+// response head are written with it in one go, so a small response
+// leaves in one TCP segment. Keep it at the TCP_MSS of lwIP, set to 0 to
+// always write the body on its own
+#ifndef SHTTP_COALESCE_SIZE
+#define SHTTP_COALESCE_SIZE 1460
+#endif
+
 // enable CJSON support
 #ifndef SHTTP_CJSON
 #define SHTTP_CJSON 1
@@ -50,6 +159,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stddef.h>
 
 #if SHTTP_CJSON
 #include <stdlib.h>
@@ -81,26 +191,37 @@ typedef shttpKeyValue shttpHeader;
 // a HTTP URL parameter
 typedef shttpKeyValue shttpParameter;
 
-// HTTP request data
+// HTTP request data, path, parameters and headers point into the
+// received data and are only valid until the route callback returns
 typedef struct _shttpRequest {
     // headers on the HTTP request
     shttpHeader *headers;
     // number of headers
     uint8_t numHeaders;
 
-    // URL parameters (those after a ?)
+    // URL parameters (those after a ?), followed by the fields of an
+    // urlencoded form body for routes set up with FORM()
     shttpParameter *parameters;
     // number of parameters
     uint8_t numParameters;
 
-    // URL path parameters (those in an URL path)
+    // URL path parameters (those in an URL path), one for every ? of the
+    // route in order
     char **pathParameters;
     // number of parameters
     uint8_t numPathParameters;
 
-    // request body
+    // names of the path parameters, NULL for a ?, and the values of typed
+    // path parameters, 0 for the others. Use shttp_path_param()
+    char **pathParameterNames;
+    int32_t *pathParameterNumbers;
+
+    // request body, a chunked transfer encoding is already decoded
     char *bodyData;
     uint16_t bodyLen;
+
+    // memory of the request, use shttp_request_alloc()
+    struct _shttpArena *arena;
 } shttpRequest;
 
 // HTTP status code to make code more readable
@@ -118,8 +239,11 @@ typedef enum _shttpStatusCode {
     shttpStatusUnauthorized = 401,
     shttpStatusForbidden = 403,
     shttpStatusNotFound = 404,
+    shttpStatusNotAllowed = 405,
     shttpStatusNotAcceptable = 406,
+    shttpStatusRequestTimeout = 408,
     shttpStatusConflict = 409,
+    shttpStatusPayloadTooLarge = 413,
     shttpStatusRequestURITooLong = 414,
 
     shttpStatusInternalError = 500,
@@ -157,7 +281,8 @@ typedef struct _shttpResponse {
     // body length,
     // - set to zero to use zero terminated string in body
     // - if set to zero using the callback, the connection is
-    //   terminated when the response finishes
+    //   terminated when the response finishes, set it to keep a
+    //   persistent connection open
     uint32_t bodyLen;
     // free body after usage
     bool free_body;
@@ -188,19 +313,86 @@ typedef enum _shttpMethod {
 
 typedef shttpResponse *(shttpRouteCallback)(shttpRequest *request);
 
+// receives the body of a request in chunks as they arrive, `data` points
+// into the received buffer and is not zero terminated. The next chunk is
+// not received before the callback returns, so a slow callback throttles
+// the client. Return false to abort the request with a 500 response.
+typedef bool (shttpRequestBodyCallback)(shttpRequest *request, char *data, uint16_t len);
+
+// one part of a multipart/form-data body
+typedef struct _shttpPart {
+    // number of the part in the body, counting from 0
+    uint8_t index;
+
+    // form field name and file name from the Content-Disposition header of
+    // the part and its Content-Type, NULL if not sent
+    char *name;
+    char *filename;
+    char *contentType;
+} shttpPart;
+
+typedef enum _shttpPartEvent {
+    shttpPartStart,  // headers of the part are complete, no data
+    shttpPartData,   // next chunk of the part content
+    shttpPartEnd     // part content is complete, no data
+} shttpPartEvent;
+
+// receives the parts of a multipart/form-data body as they arrive, the
+// content is passed on in chunks and never stored. `data` points into the
+// received buffer and is not zero terminated. Return false to abort the
+// request with a 500 response.
+typedef bool (shttpPartCallback)(shttpRequest *request, shttpPart *part, shttpPartEvent event, char *data, uint16_t len);
+
 typedef struct _shttpRoute {
     // allowed methods for this route, add them together to allow
-    // multiple methods (flags)
+    // multiple methods (flags). For a HEAD request the response is built
+    // as usual, only its head and Content-Length are sent
     shttpMethod allowedMethods;
 
     // path to match
     // - use ? for parameter, parameters may not include slashes
+    // - use {name} for a named parameter, {name:uint} for a number from 0
+    //   to INT32_MAX and {name:int} for a signed 32 bit number. A path
+    //   that does not fit the type falls through to the next route
     // - use * for wildcard. Wildcards are only allowed at the end
     char *path;
 
     // callback to call when route found
     shttpRouteCallback *callback;
 
+    // set to true if the callback may not run concurrently, with more
+    // than one data processing task all serialized routes share one
+    // lock, so only one of them runs at any time
+    bool serialized;
+
+    // set to true to queue requests for this route ahead of all others,
+    // for cheap routes like health checks that have to answer under load
+    bool priority;
+
+    // lowercase names of the headers to store for this route, closed with
+    // a NULL sentinel. Set to NULL to use the headers of the config
+    char **headers;
+
+    // set to stream the request body to this callback instead of storing
+    // it in `bodyData`, the route callback runs after the last chunk
+    shttpRequestBodyCallback *bodyCallback;
+
+    // set to split a multipart/form-data body into parts for this callback
+    // while it streams in, see MULTIPART()
+    shttpPartCallback *partCallback;
+
+    // set to decode application/x-www-form-urlencoded bodies into the
+    // request parameters, see FORM()
+    bool formParameters;
+
+    // max request body size in bytes for this route, set to 0 to use the
+    // limit of the config. Streamed bodies are only limited by this
+    uint32_t maxBodySize;
+
+    // set by shttp_route(), the route and its header list are freed when
+    // the server stops
+    bool allocated;
+
     // if you define multiple routes with the same path and different
     // allowedMethods then the list is processed until a matching
     // entry is found.
@@ -221,16 +413,133 @@ typedef struct _shttpConfig {
     bool appendSlashes;
 
     // defined routes (for callbacks), close with a NULL sentinel
-    // be aware that comparing the list is done sequentially, if no
-    // match could be found the next item is tried until we reach the
-    // end of the list and the server returns a 404
+    // shttp_listen() compiles the list into a tree, so finding a route
+    // takes as long for the last route as for the first. If more than one
+    // route matches, the first one in the list wins. Without a match the
+    // server returns a 404
     shttpRoute **routes;
+
+    // lowercase names of the headers to store in requests, closed with a
+    // NULL sentinel, all others are skipped while parsing. Routes may
+    // override this, see CAPTURE(). Set to NULL to store all headers.
+    // Content-Length, Connection, Host, Transfer-Encoding and Expect are
+    // always stored
+    char **headers;
+
+    // number of data processing tasks, set to 0 to use SHTTP_WORKERS
+    uint8_t workers;
+
+    // number of connections waiting for a data processing task, set to 0
+    // to use SHTTP_MAX_QUEUED_CONNECTIONS
+    uint8_t queueDepth;
+
+    // max request body size in bytes, set to 0 to use SHTTP_MAX_BODY_SIZE.
+    // Requests announcing a larger body are answered with 413 before the
+    // body is received
+    uint32_t maxBodySize;
+
+    // size of the request memory block of every connection, set to 0 to
+    // use SHTTP_ARENA_SIZE
+    uint16_t arenaSize;
+
+    // stack size of every data processing task, set to 0 to use
+    // SHTTP_STACK_SIZE
+    uint16_t workerStackSize;
+
+    // max number of connections served at once by the event engine,
+    // set to 0 to use SHTTP_MAX_CONNECTIONS
+    uint8_t maxConnections;
+
+    // milliseconds to wait for the next request on a persistent
+    // connection, set to 0 to use SHTTP_KEEPALIVE_TIMEOUT
+    uint32_t keepAliveTimeout;
+
+    // max requests on one persistent connection, set to 0 to use
+    // SHTTP_MAX_KEEPALIVE_REQUESTS, set to 1 to disable keep-alive
+    uint16_t maxKeepAliveRequests;
+
+    // shed connections while the free heap is below this many bytes,
+    // set to 0 to use SHTTP_SHED_FREE_HEAP
+    uint32_t shedFreeHeap;
+
+    // value of the Retry-After header of shed connections in seconds,
+    // set to 0 to use SHTTP_RETRY_AFTER
+    uint16_t retryAfter;
+
+    // milliseconds a client may take for the request line and headers,
+    // set to 0 to use SHTTP_HEADER_TIMEOUT, answered with 408
+    uint32_t headerTimeout;
+
+    // milliseconds a client may take for the request body, set to 0 to
+    // use SHTTP_BODY_TIMEOUT, answered with 408
+    uint32_t bodyTimeout;
+
+    // milliseconds a write may stall before the connection is dropped,
+    // set to 0 to use SHTTP_WRITE_TIMEOUT
+    uint32_t writeTimeout;
+
+    // routes compiled by shttp_listen(), leave it NULL unless `routes` is
+    // a table generated by tools/routegen, which sets both
+    struct _shttpRouteTree *routeTree;
 } shttpConfig;
 
-// Start the shttp server, this function does not return
-// use it in a thread or RTOS task.
+// Server statistics, use them to tune the queue depth under load
+typedef struct _shttpStats {
+    // connections accepted and queued for processing
+    uint32_t acceptedConnections;
+
+    // connections answered with 503 because the queue was full
+    uint32_t shedQueueFull;
+
+    // connections answered with 503 because the heap ran low
+    uint32_t shedLowHeap;
+} shttpStats;
+
+// Start the shttp server, this function does not return until the
+// server is stopped, use it in a thread or RTOS task.
 void shttp_listen(shttpConfig *config);
 
+// Start the shttp server on multiple ports at once, `configs` is closed
+// with a NULL sentinel and may hold up to SHTTP_MAX_LISTENERS entries.
+// Every config gets its own routes, queue, body limit and data processing
+// tasks while all ports are accepted from the calling task. Does not
+// return until the server is stopped. If the server can not be started
+// it returns right away, the routes are released as by shttp_stop() then.
+void shttp_listen_all(shttpConfig **configs);
+
+// Stop the shttp server from another task: stops accepting connections
+// on all ports, gives queued and running requests up to `drainTimeout`
+// milliseconds to finish and then releases all resources, including the
+// routes created by shttp_route(). A `routes` list holding such routes is
+// set to NULL. shttp_listen returns afterwards and may be called again
+// with a fresh set of routes to restart the server.
+// Requests still running after the timeout are dropped at their next
+// receive timeout. A route callback that does not return even then has
+// its task deleted and the memory of its connection is lost.
+// Never call this from a route callback.
+// Returns false if requests had to be aborted.
+bool shttp_stop(uint32_t drainTimeout);
+
+// Copy the current server statistics into `stats`
+void shttp_get_stats(shttpStats *stats);
+
+// Allocate memory that lives as long as the request, for building a
+// response without freeing it. The memory stays valid until the response
+// has been sent, so pass autofree = false when using it as a body.
+// Returns NULL if out of memory
+void *shttp_request_alloc(shttpRequest *request, size_t size);
+
+// Value of the path parameter {name} of the route, NULL if there is none
+char *shttp_path_param(shttpRequest *request, char *name);
+
+// Value of the path parameter {name:uint} or {name:int} of the route,
+// converted while the route was matched. 0 if there is none
+int32_t shttp_path_param_int(shttpRequest *request, char *name);
+
+// Value of the first URL or form body parameter called `name`, NULL if
+// the request has none. Parameters without value are the empty string
+char *shttp_request_parameter(shttpRequest *request, char *name);
+
 // URL encode value, caller has to free the result
 char *shttp_url_encode(char *value);
 
@@ -249,7 +558,57 @@ shttpRoute *shttp_route(shttpMethod method, char *path, shttpRouteCallback *call
 #define PATCH(_path, _callback) shttp_route(shttpMethodPATCH, (_path), (_callback))
 #define DELETE(_path, _callback) shttp_route(shttpMethodDELETE, (_path), (_callback))
 #define OPTIONS(_path, _callback) shttp_route(shttpMethodOPTIONS, (_path), (_callback))
-#define HEAD(_path, _callback) shttp_route(shttpMethodHEAD, (_path), (_callback) })
+#define HEAD(_path, _callback) shttp_route(shttpMethodHEAD, (_path), (_callback))
+
+// mark a route as not to be executed concurrently, returns the route
+// Usage: SERIALIZED(POST("/config", saveConfig))
+shttpRoute *shttp_route_serialized(shttpRoute *route);
+
+#define SERIALIZED(_route) shttp_route_serialized((_route))
+
+// queue requests for a route ahead of all others, returns the route
+// Usage: PRIORITY(GET("/health", health))
+shttpRoute *shttp_route_priority(shttpRoute *route);
+
+#define PRIORITY(_route) shttp_route_priority((_route))
+
+// only store the listed headers for a route, `headers` are lowercase
+// names closed with a NULL sentinel, returns the route. Routes created by
+// shttp_route() keep a copy of the list, the names are not copied
+// Usage: CAPTURE(POST("/upload", upload), "content-type", "x-token")
+shttpRoute *shttp_route_headers(shttpRoute *route, char **headers);
+
+#define CAPTURE(_route, ...) shttp_route_headers((_route), (char *[]){ __VA_ARGS__, NULL })
+
+// stream the request body of a route to `callback`, bodies of any size
+// are accepted as the body is not stored. Returns the route
+// Usage: STREAM(POST("/ota", otaDone), otaWrite)
+shttpRoute *shttp_route_body(shttpRoute *route, shttpRequestBodyCallback *callback);
+
+#define STREAM(_route, _callback) shttp_route_body((_route), (_callback))
+
+// stream the parts of multipart/form-data bodies of a route to `callback`,
+// for uploads larger than the memory. Other bodies are answered with 400.
+// Returns the route
+// Usage: MULTIPART(POST("/upload", uploaded), uploadPart)
+shttpRoute *shttp_route_multipart(shttpRoute *route, shttpPartCallback *callback);
+
+#define MULTIPART(_route, _callback) shttp_route_multipart((_route), (_callback))
+
+// decode urlencoded form bodies of a route into its request parameters,
+// after the URL parameters. The body is decoded in place, so `bodyData`
+// does not hold the raw body afterwards. Returns the route
+// Usage: FORM(POST("/settings", saveSettings))
+shttpRoute *shttp_route_form(shttpRoute *route);
+
+#define FORM(_route) shttp_route_form((_route))
+
+// limit the request body size of a route, larger bodies are answered
+// with 413 before they are received. Returns the route
+// Usage: LIMIT(STREAM(POST("/ota", otaDone), otaWrite), 512 * 1024)
+shttpRoute *shttp_route_limit(shttpRoute *route, uint32_t maxBodySize);
+
+#define LIMIT(_route, _maxBodySize) shttp_route_limit((_route), (_maxBodySize))
 
 shttpResponse *shttp_empty_response(shttpStatusCode status);
 
@@ -0,0 +1,77 @@
+#ifndef shttp_routetable_h_included
+#define shttp_routetable_h_included
+
+//
+// Compiled route tables
+//
+// shttp_listen() compiles the route list of a config into a tree in RAM.
+// The tree can be generated at build time instead, by the host tool in
+// tools/routegen, together with the routes. Both then live in flash and
+// no heap is used for routing. Generated tables are not meant to be
+// written by hand, the types are here for the generated code.
+//
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "simplehttp/http.h"
+
+// values a path parameter accepts
+typedef enum _shttpRouteParamType {
+    shttpRouteParamAny,   // ? or {name}, anything up to the next slash
+    shttpRouteParamUint,  // {name:uint}, 0 to INT32_MAX
+    shttpRouteParamInt    // {name:int}, INT32_MIN to INT32_MAX
+} shttpRouteParamType;
+
+// Node of the route tree. Static path characters are stored as labels of
+// the edges, parameters and `*` get a child of their own. Nodes refer to
+// each other by their index in the node array, node 0 is the root, so 0
+// means none.
+typedef struct _shttpRouteNode {
+    // static characters of the path leading to this node, not zero
+    // terminated, they point into the route path
+    const char *label;
+    uint16_t labelLen;
+
+    // first static child and the next static child of the parent, the
+    // labels of siblings start with different characters. Parameter
+    // children are linked the same way, one for every type
+    uint16_t child;
+    uint16_t sibling;
+
+    // first parameter child and the child for a `*` wildcard
+    uint16_t param;
+    uint16_t wildcard;
+
+    // first route ending here, plus one, and the methods of all routes
+    // ending here
+    uint16_t route;
+    shttpMethod methods;
+
+    // values accepted by a parameter node
+    shttpRouteParamType type;
+} shttpRouteNode;
+
+typedef struct _shttpRouteTree {
+    shttpRouteNode *nodes;
+    uint16_t numNodes;
+    uint16_t allocatedNodes;
+
+    // next route with the same path for every route, plus one, in the
+    // order of the route list
+    uint16_t *nextRoute;
+
+    // names and types of the path parameters of all routes, those of
+    // route `i` start at firstParam[i]. Names are NULL for `?`
+    char **paramNames;
+    shttpRouteParamType *paramTypes;
+    uint16_t *firstParam;
+
+    // most path parameters in one route
+    uint8_t maxParams;
+
+    // set if compiled by shttp_listen(), generated tables are never freed
+    bool allocated;
+} shttpRouteTree;
+
+#endif /* shttp_routetable_h_included */
@@ -0,0 +1,107 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <c_types.h>
+
+#include "simplehttp/http.h"
+#include "debug.h"
+
+// allocations are aligned for any pointer or integer stored in them
+#define SHTTP_ARENA_ALIGN(_size) (((_size) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+#define SHTTP_ARENA_DATA(_block) ((char *)((_block) + 1))
+
+ICACHE_FLASH_ATTR bool shttp_arena_init(shttpArena *arena, void *block, uint16_t size) {
+    arena->blockSize = size;
+    arena->embedded = (block != NULL);
+    arena->last = NULL;
+
+    if (block == NULL) {
+        block = malloc(SHTTP_ARENA_BLOCK_SIZE(size));
+        if (block == NULL) {
+            arena->blocks = NULL;
+            return false;
+        }
+    }
+
+    arena->blocks = block;
+    arena->blocks->next = NULL;
+    arena->blocks->size = size;
+    arena->blocks->used = 0;
+
+    return true;
+}
+
+ICACHE_FLASH_ATTR void *shttp_arena_alloc(shttpArena *arena, size_t size) {
+    size = SHTTP_ARENA_ALIGN(size);
+
+    shttpArenaBlock *block = arena->blocks;
+    if ((block == NULL) || (block->size - block->used < size)) {
+        // start a new block, large allocations get a block of their own
+        uint32_t blockSize = (size > arena->blockSize) ? size : arena->blockSize;
+        block = malloc(SHTTP_ARENA_BLOCK_SIZE(blockSize));
+        if (block == NULL) {
+            LOG(ERROR, "shttp: Out of memory while allocating %d bytes", size);
+            return NULL;
+        }
+        block->size = blockSize;
+        block->used = 0;
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+
+    void *result = SHTTP_ARENA_DATA(block) + block->used;
+    block->used += size;
+    arena->last = result;
+
+    return result;
+}
+
+ICACHE_FLASH_ATTR void *shttp_arena_grow(shttpArena *arena, void *data, size_t oldSize, size_t size) {
+    if (data == NULL) {
+        return shttp_arena_alloc(arena, size);
+    }
+
+    // the last allocation just takes more of its block
+    shttpArenaBlock *block = arena->blocks;
+    if ((data == arena->last) && (block != NULL)) {
+        uint32_t offset = (char *)data - SHTTP_ARENA_DATA(block);
+        if (block->size - offset >= SHTTP_ARENA_ALIGN(size)) {
+            block->used = offset + SHTTP_ARENA_ALIGN(size);
+            return data;
+        }
+    }
+
+    void *result = shttp_arena_alloc(arena, size);
+    if (result != NULL) {
+        memcpy(result, data, oldSize);
+    }
+    return result;
+}
+
+ICACHE_FLASH_ATTR void shttp_arena_reset(shttpArena *arena) {
+    if (arena->blocks == NULL) {
+        return;
+    }
+
+    // free all added blocks, the initial one is the last in the list
+    while (arena->blocks->next != NULL) {
+        shttpArenaBlock *next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+    arena->blocks->used = 0;
+    arena->last = NULL;
+}
+
+ICACHE_FLASH_ATTR void shttp_arena_destroy(shttpArena *arena) {
+    shttp_arena_reset(arena);
+    if ((arena->blocks != NULL) && (!arena->embedded)) {
+        free(arena->blocks);
+    }
+    arena->blocks = NULL;
+}
+
+ICACHE_FLASH_ATTR void *shttp_request_alloc(shttpRequest *request, size_t size) {
+    return shttp_arena_alloc(request->arena, size);
+}
@@ -0,0 +1,48 @@
+#ifndef shttp_arena_h_included
+#define shttp_arena_h_included
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// block of arena memory, the data follows the header
+typedef struct _shttpArenaBlock {
+    struct _shttpArenaBlock *next;
+    uint32_t size;
+    uint32_t used;
+} shttpArenaBlock;
+
+// bump allocator for request data, allocations are never freed one by
+// one but all at once when the arena is reset
+typedef struct _shttpArena {
+    // newest block first, the last block is the initial one
+    shttpArenaBlock *blocks;
+
+    // size of the initial block, added blocks are at least that large
+    uint16_t blockSize;
+
+    // the initial block is not allocated by the arena if set
+    bool embedded;
+
+    // last allocation, it may be grown in place
+    void *last;
+} shttpArena;
+
+// size of an embedded initial block with `size` bytes of data
+#define SHTTP_ARENA_BLOCK_SIZE(_size) (sizeof(shttpArenaBlock) + (_size))
+
+// set up an arena, if `block` is not NULL it is used as initial block of
+// SHTTP_ARENA_BLOCK_SIZE(size) bytes, otherwise the block is allocated
+bool shttp_arena_init(shttpArena *arena, void *block, uint16_t size);
+
+void *shttp_arena_alloc(shttpArena *arena, size_t size);
+
+// grow an allocation to `size` bytes, the old content is kept. The last
+// allocation grows in place if its block has room
+void *shttp_arena_grow(shttpArena *arena, void *data, size_t oldSize, size_t size);
+
+// release everything allocated, the initial block is kept
+void shttp_arena_reset(shttpArena *arena);
+void shttp_arena_destroy(shttpArena *arena);
+
+#endif /* shttp_arena_h_included */
@@ -0,0 +1,319 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+
+#include "debug.h"
+#include "simplehttp/http.h"
+
+#include "parser.h"
+#include "response.h"
+#include "server.h"
+
+#if SHTTP_EVENT_ENGINE
+
+#if !LWIP_SO_RCVTIMEO
+#error The shttp event engine needs LWIP_SO_RCVTIMEO
+#endif
+
+// interval in milliseconds to check all connections for timeouts and
+// data of events that have been missed
+#define SHTTP_ENGINE_POLL_INTERVAL 100
+
+typedef struct _shttpEngineEvent {
+    struct netconn *conn;
+    enum netconn_evt evt;
+} shttpEngineEvent;
+
+// state of one client, a free slot has no connection
+typedef struct _shttpClient {
+    shttpConnection connection;
+    shttpServer *server;
+    shttpParserState *parser;
+
+    shttpPhaseClock clock;
+
+    // close the connection after all queued responses have been written
+    bool closing;
+} shttpClient;
+
+static xQueueHandle eventQueue;
+static shttpClient *clients;
+static uint16_t maxClients;
+static shttpServer *servers;
+static uint8_t numServers;
+
+ICACHE_FLASH_ATTR void shttp_engine_event(struct netconn *conn, enum netconn_evt evt, u16_t len) {
+    if ((evt != NETCONN_EVT_RCVPLUS) && (evt != NETCONN_EVT_SENDPLUS) && (evt != NETCONN_EVT_ERROR)) {
+        return;
+    }
+
+    // this runs in the lwIP task, never block it. If the queue is full the
+    // event is lost and the connection is picked up by the next poll
+    shttpEngineEvent event = { conn, evt };
+    xQueueSendToBack(eventQueue, &event, 0);
+}
+
+ICACHE_FLASH_ATTR static shttpClient *find_client(struct netconn *conn) {
+    for(uint16_t i = 0; i < maxClients; i++) {
+        if (clients[i].connection.conn == conn) {
+            return &clients[i];
+        }
+    }
+    return NULL;
+}
+
+ICACHE_FLASH_ATTR static void close_client(shttpClient *client) {
+    shttp_connection_discard(&client->connection);
+    netconn_close(client->connection.conn);
+    netconn_delete(client->connection.conn);
+    shttp_destroy_parser(client->parser);
+    client->server->numClients--;
+
+    client->connection.conn = NULL;
+    client->parser = NULL;
+    client->server = NULL;
+    LOG(DEBUG, "shttp: connection closed");
+}
+
+ICACHE_FLASH_ATTR static void accept_clients(shttpServer *server) {
+    struct netconn *incoming;
+    shttpConfig *config = server->config;
+
+    // the listening connection does not block, accept everything pending
+    while (netconn_accept(server->listeningConn, &incoming) == ERR_OK) {
+        if (shttp_low_on_heap(config)) {
+            shttp_shed_connection(config, incoming, true);
+            continue;
+        }
+
+        // the slots are shared, but no server may take more than its share
+        shttpClient *client = NULL;
+        if (server->numClients < server->maxClients) {
+            client = find_client(NULL);
+        }
+        if (client == NULL) {
+            shttp_shed_connection(config, incoming, false);
+            continue;
+        }
+
+        client->parser = shttp_parser_init_state(config);
+        if (client->parser == NULL) {
+            LOG(ERROR, "shttp: Out of memory while creating parser");
+            shttp_shed_connection(config, incoming, true);
+            continue;
+        }
+
+        // a 1 ms timeout makes netconn_recv return immediately if there
+        // is no data
+        netconn_set_recvtimeout(incoming, 1);
+
+        client->connection.conn = incoming;
+        client->connection.config = config;
+        client->connection.nonBlocking = true;
+        client->connection.pending = NULL;
+        shttp_phase_start(&client->clock, client->parser);
+        client->closing = false;
+        client->server = server;
+        server->numClients++;
+
+        shttp_count_accepted();
+        LOG(TRACE, "shttp: Client connected");
+    }
+}
+
+// write queued responses and parse everything the client has sent
+ICACHE_FLASH_ATTR static void service_client(shttpClient *client) {
+    struct netbuf *inbuf;
+
+    // responses go out in order and nothing is read while the client does
+    // not take the responses we have for it
+    shttpWriteResult result = shttp_connection_flush(&client->connection);
+    if (result == shttpWriteError) {
+        close_client(client);
+        return;
+    }
+    if (result == shttpWritePending) {
+        return;
+    }
+    if (client->closing) {
+        close_client(client);
+        return;
+    }
+
+    while (1) {
+        err_t err = netconn_recv(client->connection.conn, &inbuf);
+        if (err == ERR_TIMEOUT) {
+            // no more data for now
+            return;
+        }
+        if (err != ERR_OK) {
+            LOG(DEBUG, "shttp: client disconnected (%d)", err);
+            close_client(client);
+            return;
+        }
+
+        // received some bytes, the parser takes the buffer
+        if (!shttp_parse(client->parser, inbuf, &client->connection)) {
+            // parser thinks we should close the connection
+            LOG(DEBUG, "shttp: parse called for quit");
+            client->closing = true;
+        }
+        shttp_phase_update(&client->clock, client->parser);
+
+        if ((client->closing) || (client->connection.pending)) {
+            break;
+        }
+    }
+
+    if ((client->closing) && (client->connection.pending == NULL)) {
+        close_client(client);
+    }
+}
+
+ICACHE_FLASH_ATTR static void check_timeout(shttpClient *client) {
+    // stalled writes are detected while flushing
+    if ((client->closing) || (client->connection.pending)) {
+        return;
+    }
+
+    if (shttp_phase_remaining(&client->clock, client->connection.config) > 0) {
+        return;
+    }
+    if (shttp_phase_expired(&client->clock, &client->connection)) {
+        client->closing = true;
+    }
+    if (client->connection.pending == NULL) {
+        close_client(client);
+    }
+}
+
+ICACHE_FLASH_ATTR static uint16_t count_clients(void) {
+    uint16_t count = 0;
+    for(uint8_t i = 0; i < numServers; i++) {
+        count += servers[i].numClients;
+    }
+    return count;
+}
+
+//
+// API
+//
+
+ICACHE_FLASH_ATTR bool shttp_engine_init(shttpServer *engineServers, uint8_t engineNumServers) {
+    uint16_t maxConnections = 0;
+    for(uint8_t i = 0; i < engineNumServers; i++) {
+        engineServers[i].numClients = 0;
+        maxConnections += engineServers[i].maxClients;
+    }
+
+    clients = malloc(maxConnections * sizeof(shttpClient));
+    if (clients == NULL) {
+        return false;
+    }
+    memset(clients, 0, maxConnections * sizeof(shttpClient));
+    maxClients = maxConnections;
+    servers = engineServers;
+    numServers = engineNumServers;
+
+    // a few events per connection, the poll catches up on lost ones
+    eventQueue = xQueueCreate(maxConnections * 4 + 4, sizeof(shttpEngineEvent));
+    if (eventQueue == NULL) {
+        free(clients);
+        clients = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+ICACHE_FLASH_ATTR bool shttp_engine_run(void) {
+    shttpEngineEvent event;
+    portTickType lastPoll = xTaskGetTickCount();
+    portTickType deadline = 0;
+    bool listening = true;
+
+    for(uint8_t i = 0; i < numServers; i++) {
+        netconn_set_recvtimeout(servers[i].listeningConn, 1);
+    }
+    LOG(DEBUG, "shttp: event engine serving up to %d connections on %d ports", maxClients, numServers);
+
+    while (1) {
+        if (xQueueReceive(eventQueue, &event, SHTTP_ENGINE_POLL_INTERVAL / portTICK_RATE_MS) == pdTRUE) {
+            shttpServer *server = shttp_find_server(event.conn);
+            if (server != NULL) {
+                accept_clients(server);
+            } else {
+                shttpClient *client = find_client(event.conn);
+                if (client != NULL) {
+                    service_client(client);
+                }
+            }
+        }
+
+        // even under a constant stream of events every connection is
+        // checked regularly
+        if ((xTaskGetTickCount() - lastPoll) * portTICK_RATE_MS < SHTTP_ENGINE_POLL_INTERVAL) {
+            continue;
+        }
+        lastPoll = xTaskGetTickCount();
+
+        // stop accepting on all ports, then let the running requests finish
+        if ((listening) && (shttp_stop_requested())) {
+            LOG(DEBUG, "shttp: stopping, draining %d connections", count_clients());
+            for(uint8_t i = 0; i < numServers; i++) {
+                struct netconn *listeningConn = servers[i].listeningConn;
+                servers[i].listeningConn = NULL;
+                netconn_close(listeningConn);
+                netconn_delete(listeningConn);
+            }
+            listening = false;
+            shttpServerDraining = true;
+            deadline = xTaskGetTickCount() + shttp_stop_drain_timeout() / portTICK_RATE_MS;
+        }
+
+        if (listening) {
+            for(uint8_t i = 0; i < numServers; i++) {
+                accept_clients(&servers[i]);
+            }
+        }
+        for(uint16_t i = 0; i < maxClients; i++) {
+            if (clients[i].connection.conn != NULL) {
+                service_client(&clients[i]);
+            }
+            if (clients[i].connection.conn != NULL) {
+                check_timeout(&clients[i]);
+            }
+        }
+
+        if (!listening) {
+            if (count_clients() == 0) {
+                return true;
+            }
+            if ((int32_t)(deadline - xTaskGetTickCount()) <= 0) {
+                return false;
+            }
+        }
+    }
+}
+
+ICACHE_FLASH_ATTR void shttp_engine_destroy(void) {
+    for(uint16_t i = 0; i < maxClients; i++) {
+        if (clients[i].connection.conn != NULL) {
+            close_client(&clients[i]);
+        }
+    }
+    free(clients);
+    clients = NULL;
+    maxClients = 0;
+    servers = NULL;
+    numServers = 0;
+
+    vQueueDelete(eventQueue);
+    eventQueue = NULL;
+}
+
+#endif /* SHTTP_EVENT_ENGINE */
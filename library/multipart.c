@@ -0,0 +1,332 @@
+#include "multipart.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "debug.h"
+#include "arena.h"
+#include "scan.h"
+#include "router.h"
+
+// boundaries are at most 70 characters (RFC 2046)
+#define SHTTP_MULTIPART_BOUNDARY_LEN 70
+
+typedef enum _shttpMultipartStep {
+    shttpMultipartStepPreamble,
+    shttpMultipartStepBoundaryEnd,
+    shttpMultipartStepHeaders,
+    shttpMultipartStepData,
+    shttpMultipartStepEpilogue,
+    shttpMultipartStepFailed
+} shttpMultipartStep;
+
+struct _shttpMultipart {
+    shttpRoute *route;
+    shttpRequest *request;
+
+    shttpMultipartStep step;
+    bool malformed;
+
+    // CRLF, two dashes and the boundary, `matched` bytes of it have been
+    // seen at the end of the data received so far
+    char delimiter[4 + SHTTP_MULTIPART_BOUNDARY_LEN];
+    uint8_t delimiterLen;
+    uint8_t matched;
+
+    // dashes after a delimiter, two of them close the body
+    uint8_t dashes;
+
+    // header line of the current part
+    char line[SHTTP_MULTIPART_LINE_SIZE];
+    uint16_t lineLen;
+
+    shttpPart part;
+    uint8_t numParts;
+};
+
+// case insensitive compare of the start of `value` against a lowercase
+// prefix
+static ICACHE_FLASH_ATTR bool shttp_multipart_prefix(const char *value, const char *prefix) {
+    while (*prefix) {
+        if (tolower((unsigned char)*value) != *prefix) {
+            return false;
+        }
+        value++;
+        prefix++;
+    }
+    return true;
+}
+
+// find the parameter `key` (lowercase, including the '=') in a header value
+// like `form-data; name="field"` and return a copy of its value, NULL if
+// it is not there
+static ICACHE_FLASH_ATTR char *shttp_multipart_param(shttpRequest *request, char *value, const char *key) {
+    size_t keyLen = strlen(key);
+
+    char *param = strchr(value, ';');
+    while (param != NULL) {
+        param++;
+        while ((*param == ' ') || (*param == '\t')) {
+            param++;
+        }
+
+        if (shttp_multipart_prefix(param, key)) {
+            param += keyLen;
+
+            // quoted or plain token
+            char *end;
+            if (*param == '"') {
+                param++;
+                end = strchr(param, '"');
+            } else {
+                end = strchr(param, ';');
+            }
+            size_t len = (end != NULL) ? (size_t)(end - param) : strlen(param);
+            while ((end == NULL) && (len > 0) && ((param[len - 1] == ' ') || (param[len - 1] == '\t'))) {
+                len--;
+            }
+
+            char *result = shttp_request_alloc(request, len + 1);
+            if (result != NULL) {
+                memcpy(result, param, len);
+                result[len] = '\0';
+            }
+            return result;
+        }
+        param = strchr(param, ';');
+    }
+    return NULL;
+}
+
+// run the part callback, a failing callback stops the parser
+static ICACHE_FLASH_ATTR bool shttp_multipart_emit(shttpMultipart *multipart, shttpPartEvent event, char *data, uint16_t len) {
+    if (!shttp_part_route(multipart->route, multipart->request, &multipart->part, event, data, len)) {
+        LOG(ERROR, "shttp: part callback aborted the request");
+        multipart->step = shttpMultipartStepFailed;
+        return false;
+    }
+    return true;
+}
+
+static ICACHE_FLASH_ATTR bool shttp_multipart_fail(shttpMultipart *multipart) {
+    LOG(ERROR, "shttp: malformed multipart body");
+    multipart->malformed = true;
+    multipart->step = shttpMultipartStepFailed;
+    return false;
+}
+
+// a header line of a part is complete, only the headers describing the
+// part are kept
+static ICACHE_FLASH_ATTR bool shttp_multipart_header(shttpMultipart *multipart) {
+    char *line = multipart->line;
+    line[multipart->lineLen] = '\0';
+
+    char *value = strchr(line, ':');
+    if (value == NULL) {
+        return shttp_multipart_fail(multipart);
+    }
+    *value++ = '\0';
+    while ((*value == ' ') || (*value == '\t')) {
+        value++;
+    }
+
+    for (char *c = line; *c; c++) {
+        *c = tolower((unsigned char)*c);
+    }
+
+    if (strcmp(FSTR("content-disposition"), line) == 0) {
+        multipart->part.name = shttp_multipart_param(multipart->request, value, FSTR("name="));
+        multipart->part.filename = shttp_multipart_param(multipart->request, value, FSTR("filename="));
+    } else if (strcmp(FSTR("content-type"), line) == 0) {
+        size_t len = strlen(value);
+        multipart->part.contentType = shttp_request_alloc(multipart->request, len + 1);
+        if (multipart->part.contentType != NULL) {
+            memcpy(multipart->part.contentType, value, len + 1);
+        }
+    }
+    return true;
+}
+
+// scan part content or the preamble for the delimiter, content is passed
+// on in runs straight from the received data. Returns the number of bytes
+// taken or -1 if the callback aborted
+static ICACHE_FLASH_ATTR int32_t shttp_multipart_content(shttpMultipart *multipart, char *data, uint16_t len) {
+    bool content = (multipart->step == shttpMultipartStepData);
+    uint16_t runStart = 0;
+    uint16_t i = 0;
+
+    while (i < len) {
+        // content can not contain the delimiter, so only a CR may start one
+        if (multipart->matched == 0) {
+            i += shttp_scan_any(data + i, len - i, "\r", 1);
+            if (i == len) {
+                break;
+            }
+        }
+
+        if (data[i] == multipart->delimiter[multipart->matched]) {
+            // pass on the content in front of a possible delimiter
+            if ((multipart->matched == 0) && (content) && (i > runStart)) {
+                if (!shttp_multipart_emit(multipart, shttpPartData, data + runStart, i - runStart)) {
+                    return -1;
+                }
+            }
+            multipart->matched++;
+            i++;
+
+            if (multipart->matched == multipart->delimiterLen) {
+                LOG(TRACE, "shttp: multipart delimiter");
+                multipart->matched = 0;
+                multipart->dashes = 0;
+                multipart->step = shttpMultipartStepBoundaryEnd;
+                if ((content) && (!shttp_multipart_emit(multipart, shttpPartEnd, NULL, 0))) {
+                    return -1;
+                }
+                return i;
+            }
+        } else if (multipart->matched > 0) {
+            // no delimiter after all, the bytes taken for one were content,
+            // they may have been received earlier so they are passed on from
+            // the copy in the delimiter
+            if ((content) && (!shttp_multipart_emit(multipart, shttpPartData, multipart->delimiter, multipart->matched))) {
+                return -1;
+            }
+            multipart->matched = 0;
+            runStart = i;
+        } else {
+            // a CR that does not start the delimiter
+            i++;
+        }
+    }
+
+    // pass on the content up to the end of the data unless it may be the
+    // start of the delimiter
+    if ((multipart->matched == 0) && (content) && (len > runStart)) {
+        if (!shttp_multipart_emit(multipart, shttpPartData, data + runStart, len - runStart)) {
+            return -1;
+        }
+    }
+    return len;
+}
+
+//
+// API
+//
+
+ICACHE_FLASH_ATTR shttpMultipart *shttp_multipart_create(shttpRoute *route, shttpRequest *request, char *contentType) {
+    if ((contentType == NULL) || (!shttp_multipart_prefix(contentType, FSTR("multipart/")))) {
+        return NULL;
+    }
+
+    shttpMultipart *multipart = shttp_request_alloc(request, sizeof(shttpMultipart));
+    if (multipart == NULL) {
+        return NULL;
+    }
+
+    char *boundary = shttp_multipart_param(request, contentType, FSTR("boundary="));
+    if ((boundary == NULL) || (boundary[0] == '\0') || (strlen(boundary) > SHTTP_MULTIPART_BOUNDARY_LEN)) {
+        LOG(ERROR, "shttp: multipart body without usable boundary");
+        return NULL;
+    }
+
+    multipart->route = route;
+    multipart->request = request;
+    multipart->step = shttpMultipartStepPreamble;
+    multipart->malformed = false;
+
+    uint8_t boundaryLen = strlen(boundary);
+    memcpy(multipart->delimiter, FSTR("\r\n--"), 4);
+    memcpy(multipart->delimiter + 4, boundary, boundaryLen);
+    multipart->delimiterLen = 4 + boundaryLen;
+
+    // the first delimiter may start the body without a line break
+    multipart->matched = 2;
+    multipart->numParts = 0;
+
+    return multipart;
+}
+
+ICACHE_FLASH_ATTR bool shttp_multipart_parse(shttpMultipart *multipart, char *data, uint16_t len) {
+    uint16_t i = 0;
+
+    while (i < len) {
+        switch (multipart->step) {
+            case shttpMultipartStepPreamble:
+            case shttpMultipartStepData: {
+                int32_t taken = shttp_multipart_content(multipart, data + i, len - i);
+                if (taken < 0) {
+                    return false;
+                }
+                i += taken;
+                break;
+            }
+
+            case shttpMultipartStepBoundaryEnd: {
+                // two dashes close the body, a line break starts a part
+                char c = data[i++];
+                if (c == '-') {
+                    if (++multipart->dashes == 2) {
+                        multipart->step = shttpMultipartStepEpilogue;
+                    }
+                } else if (multipart->dashes > 0) {
+                    return shttp_multipart_fail(multipart);
+                } else if (c == '\n') {
+                    multipart->part = (shttpPart){ multipart->numParts++, NULL, NULL, NULL };
+                    multipart->lineLen = 0;
+                    multipart->step = shttpMultipartStepHeaders;
+                } else if ((c != '\r') && (c != ' ') && (c != '\t')) {
+                    return shttp_multipart_fail(multipart);
+                }
+                break;
+            }
+
+            case shttpMultipartStepHeaders: {
+                char c = data[i++];
+                if (c == '\r') {
+                    break;
+                }
+                if (c != '\n') {
+                    if (multipart->lineLen == SHTTP_MULTIPART_LINE_SIZE - 1) {
+                        return shttp_multipart_fail(multipart);
+                    }
+                    multipart->line[multipart->lineLen++] = c;
+                    break;
+                }
+
+                // an empty line ends the headers of the part
+                if (multipart->lineLen == 0) {
+                    LOG(TRACE, "shttp: multipart part %d '%s'", multipart->part.index, multipart->part.name);
+                    multipart->step = shttpMultipartStepData;
+                    if (!shttp_multipart_emit(multipart, shttpPartStart, NULL, 0)) {
+                        return false;
+                    }
+                    break;
+                }
+                if (!shttp_multipart_header(multipart)) {
+                    return false;
+                }
+                multipart->lineLen = 0;
+                break;
+            }
+
+            case shttpMultipartStepEpilogue:
+                // anything after the closing delimiter is ignored
+                return true;
+
+            default:
+                return false;
+        }
+    }
+
+    return true;
+}
+
+ICACHE_FLASH_ATTR bool shttp_multipart_malformed(shttpMultipart *multipart) {
+    return multipart->malformed;
+}
+
+ICACHE_FLASH_ATTR bool shttp_multipart_complete(shttpMultipart *multipart) {
+    return (multipart->step == shttpMultipartStepEpilogue);
+}
@@ -0,0 +1,23 @@
+#ifndef shttp_multipart_h_included
+#define shttp_multipart_h_included
+
+#include "simplehttp/http.h"
+
+typedef struct _shttpMultipart shttpMultipart;
+
+// set up parsing a multipart/form-data body for the part callback of
+// `route`, the state is allocated from the request memory. Returns NULL if
+// `contentType` is not multipart or has no boundary
+shttpMultipart *shttp_multipart_create(shttpRoute *route, shttpRequest *request, char *contentType);
+
+// parse the next piece of the body, returns false if the body is
+// malformed or the part callback aborted the request
+bool shttp_multipart_parse(shttpMultipart *multipart, char *data, uint16_t len);
+
+// true if parsing failed on a malformed body
+bool shttp_multipart_malformed(shttpMultipart *multipart);
+
+// true if the closing delimiter has been seen
+bool shttp_multipart_complete(shttpMultipart *multipart);
+
+#endif /* shttp_multipart_h_included */
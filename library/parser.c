@@ -9,7 +9,10 @@
 #include <string.h>
 
 #include "debug.h"
+#include "arena.h"
+#include "scan.h"
 #include "router.h"
+#include "multipart.h"
 #include "urlcoder.h"
 #include "response.h"
 
@@ -20,404 +23,1231 @@
      _a < _b ? _a : _b; })
 #endif
 
-extern shttpConfig *shttpServerConfig;
+// initial size of the buffer for a token split over segments
+#define SHTTP_CARRY_SIZE 32
+
+extern volatile bool shttpServerDraining;
+
+// where the parser is in the request, the parser can stop after every
+// byte and resumes there with the next segment
+typedef enum _shttpParserStep {
+    shttpParserStepMethod,
+    shttpParserStepPath,
+    shttpParserStepQueryKey,
+    shttpParserStepQueryValue,
+    shttpParserStepVersion,
+    shttpParserStepHeaderStart,
+    shttpParserStepHeaderName,
+    shttpParserStepHeaderValueStart,
+    shttpParserStepHeaderValue,
+    shttpParserStepHeaderSkip,
+    shttpParserStepBody,
+    shttpParserStepChunkSize,
+    shttpParserStepChunkExtension,
+    shttpParserStepChunkEnd,
+    shttpParserStepComplete
+} shttpParserStep;
+
+// initial size of a body with chunked transfer encoding
+#define SHTTP_CHUNKED_BODY_SIZE 64
 
 typedef struct _shttpParserState {
-    bool introductionFinished;
-    bool headerFinished;
+    shttpConfig *config;
+
+    // memory of the current request, the initial block follows the state
+    shttpArena arena;
+
+    shttpParserStep step;
     uint32_t expectedBodySize;
+    uint32_t bodyReceived;
+
+    // chunked transfer encoding: bytes left of the current chunk, digits
+    // of its size line and the size of the body buffer. `trailers` is set
+    // while the header fields after the last chunk are parsed
+    bool chunked;
+    bool trailers;
+    uint32_t chunkRemaining;
+    uint8_t chunkDigits;
+    uint32_t bodySize;
+
+    // persistent connection handling
+    bool keepAlive;
+    uint16_t numRequests;
 
     shttpRequest request;
     shttpMethod method;
     char *path;
 
+    // route found after the request line and the headers it needs, the
+    // methods other routes allow for the path if there is none
+    shttpRoute *route;
+    char **capture;
+    shttpMethod allowed;
+
+    // set if the Host header does not match the config
+    bool hostMismatch;
+
+    // the client waits for 100 Continue before sending the body, only
+    // HTTP/1.1 clients may be sent one
+    bool expectContinue;
+    bool http10;
+
+    // response sent instead of running the route
+    shttpResponse *rejection;
+
+    // Content-Type of the request and the parts of a multipart body being
+    // split for the part callback of the route
+    char *contentType;
+    shttpMultipart *multipart;
+
     uint8_t allocatedHeaders;
     uint8_t allocatedParameters;
+
+    // method and protocol version are short, they are collected here
+    char word[9];
+    uint8_t wordLen;
+
+    // the token being collected, it is written in place in the segment
+    // starting at `token`. If the segment ends first it continues in
+    // `carry`. Header names are lowercased and parameters URL decoded
+    // while they are written, `tokenTrim` is the length without
+    // trailing whitespace
+    char *token;
+    bool tokenCarried;
+    uint16_t tokenLen;
+    uint16_t tokenTrim;
+
+    // URL decoding state: 0 normal, 1 after %, 2 after the first digit
+    uint8_t decodeStep;
+    uint8_t decodeValue;
+
+    // parameter name or header name waiting for its value
+    char *name;
+
+    // path, parameters and headers point into the received data, the
+    // netbufs they are in are chained into `held` until the request is
+    // finished. `holdCurrent` is set if the netbuf being parsed is needed
+    struct netbuf *held;
+    bool holdCurrent;
+
+    // copy of a token split over segments, allocated from the arena
+    char *carry;
+    uint16_t carrySize;
+
+    // bytes of request line and headers received
+    uint16_t headerSize;
 } shttpParserState;
 
-static __attribute__((noinline)) ICACHE_FLASH_ATTR bool shttp_parse_introduction(shttpParserState *state) {
-    char *data = state->request.bodyData;
-    uint16_t len = state->request.bodyLen;
-    uint16_t i; // parser index
-
-    // find method
-    if (strncmp(FSTR("GET "), data, MIN(4, len)) == 0) {
-        state->method = shttpMethodGET;
-        i = 4;
-    } else
-    if (strncmp(FSTR("POST "), data, MIN(5, len)) == 0) {
-        state->method = shttpMethodPOST;
-        i = 5;
-    } else
-    if (strncmp(FSTR("PUT "), data, MIN(4, len)) == 0) {
-        state->method = shttpMethodPUT;
-        i = 4;
-    } else
-    if (strncmp(FSTR("PATCH "), data, MIN(6, len)) == 0) {
-        state->method = shttpMethodPATCH;
-        i = 6;
-    } else
-    if (strncmp(FSTR("DELETE "), data, MIN(7, len)) == 0) {
-        state->method = shttpMethodDELETE;
-        i = 7;
-    } else
-    if (strncmp(FSTR("OPTIONS "), data, MIN(8, len)) == 0) {
-        state->method = shttpMethodOPTIONS;
-        i = 8;
-    } else
-    if (strncmp(FSTR("HEAD "), data, MIN(5, len)) == 0) {
-        state->method = shttpMethodHEAD;
-        i = 5;
+// empty strings and the body of requests without one, never freed
+static char shttpEmptyString[1];
+
+// case insensitive compare of a Host header against the host name, a port
+// in the header is ignored
+static ICACHE_FLASH_ATTR bool shttp_host_equals(const char *value, const char *hostName) {
+    while (*hostName) {
+        if (tolower((unsigned char)*value) != tolower((unsigned char)*hostName)) {
+            return false;
+        }
+        value++;
+        hostName++;
+    }
+    return ((*value == '\0') || (*value == ':'));
+}
+
+// case insensitive compare of a header value against a lowercase token
+static ICACHE_FLASH_ATTR bool shttp_token_equals(const char *value, const char *token) {
+    while (*token) {
+        if (tolower((unsigned char)*value) != *token) {
+            return false;
+        }
+        value++;
+        token++;
+    }
+    return (*value == '\0');
+}
+
+//
+// Tokens
+//
+
+// called for every byte of a token before it is written, `at` is the
+// position of the byte in the segment. Written data never gets ahead of
+// the data read, so tokens can be written in place
+static inline void shttp_token_touch(shttpParserState *state, char *at) {
+    if ((state->token == NULL) && (!state->tokenCarried)) {
+        state->token = at;
+    }
+}
+
+static ICACHE_FLASH_ATTR bool shttp_token_put(shttpParserState *state, char c) {
+    if (state->tokenCarried) {
+        // keep room for the terminator, the buffer grows in doubling steps
+        // so a token arriving byte by byte is not copied over and over
+        if (state->tokenLen + 1 >= state->carrySize) {
+            char *carry = shttp_arena_grow(&state->arena, state->carry, state->carrySize, 2 * state->carrySize);
+            if (carry == NULL) {
+                LOG(ERROR, "shttp: Out of memory while building buffer");
+                return false;
+            }
+            state->carrySize *= 2;
+            state->carry = carry;
+        }
+        state->carry[state->tokenLen++] = c;
     } else {
-        return false;
+        state->token[state->tokenLen++] = c;
     }
 
-    LOG(TRACE, "shttp: parser -> method: %d", state->method);
+    if ((c != ' ') && (c != '\t')) {
+        state->tokenTrim = state->tokenLen;
+    }
+    return true;
+}
 
-    // get path until the ? (if there is one)
-    bool parameters = false;
+// put a byte of an URL encoded token
+static ICACHE_FLASH_ATTR bool shttp_token_put_encoded(shttpParserState *state, char c) {
+    int8_t digit = shttp_hex_value(c);
 
-    state->path = malloc(len - i);
-    char *buf = state->path;
-    for(; i < len; i++) {
-        if ((data[i] != '?') && (data[i] != ' ')) {
-            *buf++ = data[i];
-        } else {
-            if (data[i] == '?') {
-                parameters = true;
+    switch (state->decodeStep) {
+        case 1:
+            if (digit >= 0) {
+                state->decodeValue = digit;
+                state->decodeStep = 2;
+                return true;
+            }
+            state->decodeStep = 0;
+            if (!shttp_token_put(state, '%')) {
+                return false;
             }
             break;
-        }
+        case 2:
+            state->decodeStep = 0;
+            if (digit >= 0) {
+                return shttp_token_put(state, (char)((state->decodeValue << 4) | digit));
+            }
+            if ((!shttp_token_put(state, '%')) || (!shttp_token_put(state, "0123456789abcdef"[state->decodeValue]))) {
+                return false;
+            }
+            break;
+        default:
+            break;
     }
-    *buf++ = '\0';
-
-    LOG(TRACE, "shttp: parser -> path: '%s'", state->path);
-
-    // read parameters
-    if (parameters) {
-        uint16_t keyStart = i;
-        uint16_t valueStart = 0;
-        for(; i < len; i++) {
-            if (data[i] == '=') {
-                // key ended, value started
-                valueStart = i + 1;
-            }
-            if ((data[i] == '&') || (data[i] == ' ')) {
-                // if we find an ampersand or a space the value ended
-                // key = keyStart -> valueStart - 2
-                // value = valueStart -> i - 1
-
-                // at first check if we have to re-alloc the parameter list
-                if (state->allocatedParameters < state->request.numParameters + 1) {
-                    state->request.parameters = realloc(state->request.parameters, sizeof(shttpParameter) * (state->allocatedParameters + 1));
-                    if (state->request.parameters == NULL) {
-                        state->request.numParameters = 0;
-                        state->allocatedParameters = 0;
-                        LOG(ERROR, "shttp: Out of memory while parsing intro");
-                        return false;
-                    }
 
-                    state->allocatedParameters++;
-                }
-                
-                uint8_t tmpLen;
-                
-                // copy key
-                tmpLen = (valueStart - 2) - keyStart;
-                char *name = shttp_url_decode_buffer(data + keyStart, tmpLen);
+    if (c == '%') {
+        state->decodeStep = 1;
+        return true;
+    }
+    return shttp_token_put(state, (c == '+') ? ' ' : c);
+}
 
-                // copy value
-                tmpLen = (i - 1) - valueStart;
-                char *value = shttp_url_decode_buffer(data + valueStart, tmpLen);
+// the segment ends while a token is collected, continue it in a copy
+static ICACHE_FLASH_ATTR bool shttp_token_carry(shttpParserState *state) {
+    if (state->token == NULL) {
+        return true;
+    }
 
-                LOG(TRACE, "shttp: parser parameter -> '%s': '%s'", name, value);
+    uint16_t size = SHTTP_CARRY_SIZE;
+    while (size <= state->tokenLen) {
+        size *= 2;
+    }
+    state->carry = shttp_arena_alloc(&state->arena, size);
+    if (state->carry == NULL) {
+        LOG(ERROR, "shttp: Out of memory while building buffer");
+        return false;
+    }
+    state->carrySize = size;
+    memcpy(state->carry, state->token, state->tokenLen);
 
-                // now append the new parameter
-                state->request.parameters[state->request.numParameters] = (shttpParameter){ name, value };
+    state->token = NULL;
+    state->tokenCarried = true;
+    return true;
+}
 
-                // increment the param count
-                state->request.numParameters++;
+// append a run of bytes that need no conversion to the token, returns
+// where the run has been written or NULL if out of memory
+static ICACHE_FLASH_ATTR char *shttp_token_run(shttpParserState *state, char *at, uint16_t run) {
+    char *written;
 
-                // set next key start to next char
-                keyStart = i + 1;
-                valueStart = 0;
+    shttp_token_touch(state, at);
+    if (state->tokenCarried) {
+        if (state->tokenLen + run >= state->carrySize) {
+            uint16_t size = state->carrySize;
+            while (state->tokenLen + run >= size) {
+                size *= 2;
             }
-            if (data[i] == ' ') {
-                // this means the end of the parameter list
-                break;
+            char *carry = shttp_arena_grow(&state->arena, state->carry, state->carrySize, size);
+            if (carry == NULL) {
+                LOG(ERROR, "shttp: Out of memory while building buffer");
+                return NULL;
             }
+            state->carrySize = size;
+            state->carry = carry;
         }
+        written = state->carry + state->tokenLen;
+        memcpy(written, at, run);
+    } else {
+        // decoding may have shortened the token, then the run moves down
+        written = state->token + state->tokenLen;
+        if (written != at) {
+            memmove(written, at, run);
+        }
+    }
+
+    // trailing whitespace of the run is not part of the trimmed token
+    uint16_t trimmed = run;
+    while ((trimmed > 0) && ((written[trimmed - 1] == ' ') || (written[trimmed - 1] == '\t'))) {
+        trimmed--;
+    }
+    if (trimmed > 0) {
+        state->tokenTrim = state->tokenLen + trimmed;
+    }
+    state->tokenLen += run;
+
+    return written;
+}
+
+// finish the token and return it zero terminated, trailing whitespace is
+// removed if `trim` is set
+static ICACHE_FLASH_ATTR char *shttp_token_end(shttpParserState *state, bool trim) {
+    char *result;
+
+    // incomplete escape sequences are kept as they are
+    if (state->decodeStep == 1) {
+        shttp_token_put(state, '%');
+    } else if (state->decodeStep == 2) {
+        shttp_token_put(state, '%');
+        shttp_token_put(state, "0123456789abcdef"[state->decodeValue]);
+    }
+    state->decodeStep = 0;
+
+    uint16_t len = (trim) ? state->tokenTrim : state->tokenLen;
+    if (state->tokenCarried) {
+        // the request points into the copy now, it stays in the arena
+        result = state->carry;
+        result[len] = '\0';
+        state->carry = NULL;
+    } else if (state->token != NULL) {
+        result = state->token;
+        result[len] = '\0';
+        state->holdCurrent = true;
+    } else {
+        result = shttpEmptyString;
+    }
+
+    state->token = NULL;
+    state->tokenCarried = false;
+    state->tokenLen = 0;
+    state->tokenTrim = 0;
+
+    return result;
+}
+
+//
+// Request parts
+//
+
+ICACHE_FLASH_ATTR uint16_t shttp_parse_method(char *data, uint16_t len, shttpMethod *method) {
+    if (len < 4) {
+        return 0;
     }
 
-    // find line break, move data in buffer and shrink buffer
-    for(; i < len - 1; i++) {
-        if ((data[i] == '\r') && (data[i + 1] == '\n')) {
-            uint16_t newLen = state->request.bodyLen - i - 2;
-            LOG(TRACE, "shttp: http request intro consumed %d bytes", state->request.bodyLen - newLen);
-            memmove(state->request.bodyData, state->request.bodyData + i + 2, newLen);
-            state->request.bodyData = realloc(state->request.bodyData, newLen);
-            state->request.bodyLen = newLen;
-            state->introductionFinished = true;
+    // the first four bytes tell the method, longer names are checked
+    // with one more compare
+    switch (shttp_load4(data)) {
+        case SHTTP_PACK4('G', 'E', 'T', ' '):
+            *method = shttpMethodGET;
+            return 4;
+        case SHTTP_PACK4('P', 'U', 'T', ' '):
+            *method = shttpMethodPUT;
+            return 4;
+        case SHTTP_PACK4('P', 'O', 'S', 'T'):
+            if ((len >= 5) && (data[4] == ' ')) {
+                *method = shttpMethodPOST;
+                return 5;
+            }
+            break;
+        case SHTTP_PACK4('H', 'E', 'A', 'D'):
+            if ((len >= 5) && (data[4] == ' ')) {
+                *method = shttpMethodHEAD;
+                return 5;
+            }
+            break;
+        case SHTTP_PACK4('P', 'A', 'T', 'C'):
+            if ((len >= 6) && (data[4] == 'H') && (data[5] == ' ')) {
+                *method = shttpMethodPATCH;
+                return 6;
+            }
             break;
+        case SHTTP_PACK4('D', 'E', 'L', 'E'):
+            if ((len >= 7) && (shttp_load4(data + 3) == SHTTP_PACK4('E', 'T', 'E', ' '))) {
+                *method = shttpMethodDELETE;
+                return 7;
+            }
+            break;
+        case SHTTP_PACK4('O', 'P', 'T', 'I'):
+            if ((len >= 8) && (shttp_load4(data + 4) == SHTTP_PACK4('O', 'N', 'S', ' '))) {
+                *method = shttpMethodOPTIONS;
+                return 8;
+            }
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+static ICACHE_FLASH_ATTR bool shttp_add_parameter(shttpParserState *state, char *name, char *value) {
+    // parameters without a name are dropped
+    if (*name == '\0') {
+        return true;
+    }
+
+    // at first check if we have to re-alloc the parameter list
+    if (state->request.numParameters == UINT8_MAX) {
+        LOG(ERROR, "shttp: Too many parameters");
+        return false;
+    }
+    if (state->allocatedParameters < state->request.numParameters + 1) {
+        uint16_t allocate = (state->allocatedParameters > 0) ? MIN(2 * state->allocatedParameters, UINT8_MAX) : 4;
+        state->request.parameters = shttp_arena_grow(&state->arena, state->request.parameters, sizeof(shttpParameter) * state->allocatedParameters, sizeof(shttpParameter) * allocate);
+        if (state->request.parameters == NULL) {
+            state->request.numParameters = 0;
+            state->allocatedParameters = 0;
+            LOG(ERROR, "shttp: Out of memory while parsing intro");
+            return false;
         }
+
+        state->allocatedParameters = allocate;
     }
 
+    LOG(TRACE, "shttp: parser parameter -> '%s': '%s'", name, value);
+    state->request.parameters[state->request.numParameters] = (shttpParameter){ name, value };
+    state->request.numParameters++;
+
     return true;
 }
 
-static __attribute__((noinline)) ICACHE_FLASH_ATTR bool shttp_parse_headers(shttpParserState *state) {
-    char *data = state->request.bodyData;
-    uint16_t len = state->request.bodyLen;
-    uint16_t keyStart = UINT16_MAX;
-    uint16_t valueStart = UINT16_MAX;
+static ICACHE_FLASH_ATTR bool shttp_add_header(shttpParserState *state, char *name, char *value) {
+    // at first check if we have to re-alloc the header list
+    if (state->request.numHeaders == UINT8_MAX) {
+        LOG(ERROR, "shttp: Too many headers");
+        return false;
+    }
+    if (state->allocatedHeaders < state->request.numHeaders + 1) {
+        uint16_t allocate = (state->allocatedHeaders > 0) ? MIN(2 * state->allocatedHeaders, UINT8_MAX) : 8;
+        state->request.headers = shttp_arena_grow(&state->arena, state->request.headers, sizeof(shttpHeader) * state->allocatedHeaders, sizeof(shttpHeader) * allocate);
+        if (state->request.headers == NULL) {
+            state->request.numHeaders = 0;
+            state->allocatedHeaders = 0;
+            LOG(ERROR, "shttp: Out of memory while parsing headers");
+            return false;
+        }
 
-    if (len < 5) {
-        return true;
+        state->allocatedHeaders = allocate;
     }
 
-    // split out headers
-    for(uint16_t i = 0; i < len - 1; i++) {
-        // if we find a ':' and have not already started the value
-        // we start the value at the first non-whitespace char after
-        // the ':'
-        if ((data[i] == ':') && (valueStart == UINT16_MAX)) {
-            // skip over whitespace
-            for (uint16_t j = i + 1; j < len; j++) {
-                if ((data[j] != ' ') && (data[j] != '\t')) {
-                    valueStart = j;
-                    break;
-                }
-            }
-            continue;
-        } else if ((keyStart == UINT16_MAX) && (data[i] != '\r') && (data[i] != '\n')) {
-            keyStart = i;
+    LOG(TRACE, "shttp: parser -> header: '%s: %s'", name, value);
+    state->request.headers[state->request.numHeaders] = (shttpHeader){ name, value };
+    state->request.numHeaders++;
+
+    // handle special headers directly, trailers can not change the framing
+    if (state->trailers) {
+        return true;
+    }
+    if ((strlen(name) == 14) && (strcmp(FSTR("content-length"), name) == 0)) {
+        state->expectedBodySize = atoi(value);
+    }
+    if ((strlen(name) == 17) && (strcmp(FSTR("transfer-encoding"), name) == 0)) {
+        // chunked is always the last encoding applied
+        size_t len = strlen(value);
+        state->chunked = ((len >= 7) && (shttp_token_equals(value + len - 7, FSTR("chunked"))));
+    }
+    if ((strlen(name) == 10) && (strcmp(FSTR("connection"), name) == 0)) {
+        if (shttp_token_equals(value, FSTR("close"))) {
+            state->keepAlive = false;
+        } else if (shttp_token_equals(value, FSTR("keep-alive"))) {
+            state->keepAlive = true;
         }
+    }
+    if ((strlen(name) == 12) && (strcmp(FSTR("content-type"), name) == 0)) {
+        state->contentType = value;
+    }
+    if ((strlen(name) == 6) && (strcmp(FSTR("expect"), name) == 0)) {
+        state->expectContinue = shttp_token_equals(value, FSTR("100-continue"));
+    }
+    if ((state->config->hostName != NULL) && (strlen(name) == 4) && (strcmp(FSTR("host"), name) == 0)) {
+        state->hostMismatch = !shttp_host_equals(value, state->config->hostName);
+    }
 
-        // line break so header line is finished
-        if ((data[i] == '\r') && (data[i + 1] == '\n')) {
-            // no k/v pair in this line -> end of header block, shrink buffer
-            if ((keyStart == UINT16_MAX) && (valueStart == UINT16_MAX)) {
-                uint16_t newLen = state->request.bodyLen - i - 2;
-                memmove(state->request.bodyData, state->request.bodyData + i + 2, newLen);
-                state->request.bodyData = realloc(state->request.bodyData, newLen + 1);
-                state->request.bodyData[newLen] = '\0'; // zero terminate to be sure
-                state->request.bodyLen = newLen;
-                state->headerFinished = true;
-                return true;
-            }
-            if (valueStart == UINT16_MAX) {
-                // Only a key without a value? Parse error!
-                return false;
-            }
+    return true;
+}
 
-            // at first check if we have to re-alloc the header list
-            if (state->allocatedHeaders < state->request.numHeaders + 1) {
-                state->request.headers = realloc(state->request.headers, sizeof(shttpHeader) * (state->allocatedHeaders + 1));
-                if (state->request.headers == NULL) {
-                    state->request.numHeaders = 0;
-                    state->allocatedHeaders = 0;
-                    LOG(ERROR, "shttp: Out of memory while parsing headers");
-                    return false;
-                }
+// true if the header has to be stored for the route or the parser
+static ICACHE_FLASH_ATTR bool shttp_capture_header(shttpParserState *state, char *name) {
+    if (state->capture == NULL) {
+        return true;
+    }
 
-                state->allocatedHeaders++;
-            }
-            
-            uint8_t tmpLen;
-            
-            // copy key
-            tmpLen = (valueStart - 1) - keyStart;
-            char *name = malloc(tmpLen + 1);
-            memcpy(name, data + keyStart, tmpLen);
-            for (uint8_t j = 0; j < tmpLen; j++) {
-                name[j] = tolower(name[j]);
-            }
-            name[tmpLen - 1] = '\0';
-
-            // copy value
-            tmpLen = (i + 1) - valueStart;
-            char *value = malloc(tmpLen + 1);
-            memcpy(value, data + valueStart, tmpLen);
-            value[tmpLen - 1] = '\0';
-        
-            LOG(TRACE, "shttp: parser -> header: '%s: %s'", name, value);
-
-            // now append the new parameter
-            state->request.headers[state->request.numHeaders] = (shttpHeader){ name, value };
-
-            // increment the param count
-            state->request.numHeaders++;
-
-            // handle special headers directly
-            if ((strlen(name) == 14) && (strcmp(FSTR("content-length"), name) == 0)) {
-                state->expectedBodySize = atoi(value);
-            }
-            if ((shttpServerConfig->hostName != NULL) && (strlen(name) == 4) && (strcmp(FSTR("host"), name) == 0)) {
-                if (strcmp(shttpServerConfig->hostName, value) != 0) {
-                    // FIXME: wrong host return a response immediately                        
-                }
-            }
+    // headers the parser needs itself
+    if ((strcmp(FSTR("content-length"), name) == 0) || (strcmp(FSTR("connection"), name) == 0) ||
+        (strcmp(FSTR("host"), name) == 0) || (strcmp(FSTR("transfer-encoding"), name) == 0) ||
+        (strcmp(FSTR("expect"), name) == 0)) {
+        return true;
+    }
 
-            // reset starting positions
-            keyStart = UINT16_MAX;
-            valueStart = UINT16_MAX;
+    // the boundary of a multipart body and the type of a form body are in
+    // the Content-Type, there is no route for 404 and 405 requests
+    if ((state->route != NULL) && ((state->route->partCallback != NULL) || (state->route->formParameters)) && (strcmp(FSTR("content-type"), name) == 0)) {
+        return true;
+    }
+
+    for (char **header = state->capture; *header != NULL; header++) {
+        if (strcmp(*header, name) == 0) {
+            return true;
         }
     }
+    return false;
+}
+
+// reset the request part of the state to be ready for the next request
+static ICACHE_FLASH_ATTR void shttp_parser_reset_request(shttpParserState *state) {
+    state->step = shttpParserStepMethod;
+    state->expectedBodySize = 0;
+    state->bodyReceived = 0;
+    state->chunked = false;
+    state->trailers = false;
+    state->chunkRemaining = 0;
+    state->chunkDigits = 0;
+    state->bodySize = 0;
+    state->keepAlive = true;
+
+    state->request.numHeaders = 0;
+    state->allocatedHeaders = 0;
+    state->request.headers = NULL;
 
-    return true; // await more data
+    state->request.numParameters = 0;
+    state->allocatedParameters = 0;
+    state->request.parameters = NULL;
+
+    state->request.numPathParameters = 0;
+    state->request.pathParameters = NULL;
+    state->request.pathParameterNames = NULL;
+    state->request.pathParameterNumbers = NULL;
+
+    state->request.bodyData = NULL;
+    state->request.bodyLen = 0;
+
+    state->path = NULL;
+    state->route = NULL;
+    state->capture = NULL;
+    state->allowed = 0;
+    state->hostMismatch = false;
+    state->expectContinue = false;
+    state->http10 = false;
+    state->rejection = NULL;
+    state->contentType = NULL;
+    state->multipart = NULL;
+
+    state->wordLen = 0;
+    state->token = NULL;
+    state->tokenCarried = false;
+    state->tokenLen = 0;
+    state->tokenTrim = 0;
+    state->decodeStep = 0;
+    state->name = NULL;
+
+    state->held = NULL;
+    state->holdCurrent = false;
+    state->carry = NULL;
+    state->carrySize = 0;
+    state->headerSize = 0;
 }
 
+// free everything allocated while parsing a request. The memory of the
+// request is kept if `keepMemory` is set, a response that has not been
+// sent yet may still use it
+static ICACHE_FLASH_ATTR void shttp_parser_free_request(shttpParserState *state, bool keepMemory) {
+    // free received data
+    if (state->held != NULL) {
+        netbuf_delete(state->held);
+    }
+
+    // everything else was allocated from the arena
+    if (!keepMemory) {
+        shttp_arena_reset(&state->arena);
+    }
+}
 
-//
-// API
-//
+// true if the body of the request goes to the body or part callback of
+// the route
+static inline bool shttp_parser_streaming(shttpParserState *state) {
+    return ((state->route != NULL) && ((state->route->bodyCallback != NULL) || (state->route->partCallback != NULL)));
+}
 
-ICACHE_FLASH_ATTR shttpParserState *shttp_parser_init_state(void) {
-    shttpParserState *result = malloc(sizeof(shttpParserState));
-    result->introductionFinished = false;
-    result->headerFinished = false;
-    result->expectedBodySize = 0;
-    
-    result->request.numHeaders = 0;
-    result->allocatedHeaders = 5;
-    result->request.headers = malloc(5 * sizeof(shttpHeader));
-    
-    result->request.numParameters = 0;
-    result->allocatedParameters = 0;
-    result->request.parameters = NULL;
-
-    result->request.numPathParameters = 0;
-    result->request.pathParameters = NULL;
-
-    result->request.bodyData = NULL;
-    result->request.bodyLen = 0;
+// largest body accepted for the route, streamed bodies are only limited
+// by the route, stored bodies also by the config and `bodyLen`
+static ICACHE_FLASH_ATTR uint32_t shttp_max_body_size(shttpParserState *state) {
+    if ((state->route != NULL) && (state->route->maxBodySize > 0)) {
+        return (shttp_parser_streaming(state)) ? state->route->maxBodySize : MIN(state->route->maxBodySize, UINT16_MAX);
+    }
+    if (shttp_parser_streaming(state)) {
+        return UINT32_MAX;
+    }
 
-    return result;
+    uint32_t maxBodySize = (state->config->maxBodySize > 0) ? state->config->maxBodySize : SHTTP_MAX_BODY_SIZE;
+    return MIN(maxBodySize, UINT16_MAX);
 }
 
-ICACHE_FLASH_ATTR bool shttp_parse(shttpParserState *state, char *buffer, uint16_t len, struct netconn *conn) {
-    bool result = true;
+// decide about a request as soon as its headers are complete, returns the
+// response rejecting it or NULL to go on
+static ICACHE_FLASH_ATTR shttpResponse *shttp_check_request(shttpParserState *state) {
+    if (state->hostMismatch) {
+        LOG(DEBUG, "shttp: request for another host");
+        return shttp_empty_response(shttpStatusBadRequest);
+    }
+    if (state->route == NULL) {
+        return shttp_no_route_response(state->allowed);
+    }
+    if ((!state->chunked) && (state->expectedBodySize > shttp_max_body_size(state))) {
+        LOG(ERROR, "shttp: HTTP request too long");
+        return shttp_empty_response(shttpStatusPayloadTooLarge);
+    }
+    if (state->route->partCallback != NULL) {
+        state->multipart = shttp_multipart_create(state->route, &state->request, state->contentType);
+        if (state->multipart == NULL) {
+            LOG(DEBUG, "shttp: no multipart body for part callback");
+            return shttp_empty_response(shttpStatusBadRequest);
+        }
+    }
+    return NULL;
+}
 
-    if (state->request.bodyData) {
-        // realloc internalized buffer to contain buffer
-        if (state->request.bodyLen + len > SHTTP_MAX_BODY_SIZE) {
-            LOG(ERROR, "shttp: HTTP request too long");
-            shttp_write_response(shttp_empty_response(shttpStatusBadRequest), conn);
+// headers are complete, prepare for the body
+static ICACHE_FLASH_ATTR bool shttp_start_body(shttpParserState *state, shttpConnection *connection) {
+    // a request that can not succeed is answered before its body is sent,
+    // the connection is closed instead of receiving the body
+    shttpResponse *rejection = shttp_check_request(state);
+    if (rejection != NULL) {
+        if ((state->chunked) || (state->expectedBodySize > 0)) {
+            shttp_write_response(rejection, connection, false, (state->method == shttpMethodHEAD));
             return false;
         }
-        state->request.bodyData = realloc(state->request.bodyData, state->request.bodyLen + len);
-    } else {
-        // create internalized buffer
-        state->request.bodyData = malloc(len);
+
+        // without a body the connection may be re-used, the response is
+        // sent in place of running the route
+        state->rejection = rejection;
+        state->expectedBodySize = 0;
+        state->step = shttpParserStepBody;
+        state->request.bodyData = shttpEmptyString;
+        return true;
+    }
+
+    // the request passed all checks, let a waiting client send the body
+    if ((state->expectContinue) && (!state->http10) && ((state->chunked) || (state->expectedBodySize > 0))) {
+        LOG(TRACE, "shttp: parser -> 100 continue");
+        shttp_write_continue(connection);
+    }
+
+    // a streamed body is passed on as it arrives, it is not stored. The
+    // size of a chunked body is not known up front, its buffer grows
+    // while the chunks arrive
+    state->step = (state->chunked) ? shttpParserStepChunkSize : shttpParserStepBody;
+    state->request.bodyData = shttpEmptyString;
+    if ((shttp_parser_streaming(state)) || (state->chunked)) {
+        return true;
+    }
+
+    if (state->expectedBodySize == 0) {
+        return true;
     }
-    if (!state->request.bodyData) {
+
+    // the length is known, so the body is copied into one buffer
+    state->request.bodyData = shttp_arena_alloc(&state->arena, state->expectedBodySize + 1);
+    if (state->request.bodyData == NULL) {
         LOG(ERROR, "shttp: Out of memory while building buffer");
         return false;
     }
+    state->request.bodyData[state->expectedBodySize] = '\0'; // zero terminate to be sure
+    state->bodySize = state->expectedBodySize + 1;
 
-    // copy buffer to internal buffer
-    LOG(TRACE, "shttp: received %d bytes, appending to %d in buffer", len, state->request.bodyLen);
-    memcpy(state->request.bodyData + state->request.bodyLen, buffer, len);
+    return true;
+}
+
+// store received body data, the buffer of a chunked body is grown as
+// needed. Returns false if the body does not fit
+static ICACHE_FLASH_ATTR bool shttp_append_body(shttpParserState *state, char *data, uint16_t len, shttpConnection *connection) {
+    uint32_t needed = state->request.bodyLen + len + 1;
+    if (needed > state->bodySize) {
+        uint32_t maxBodySize = shttp_max_body_size(state);
+        if (needed - 1 > maxBodySize) {
+            LOG(ERROR, "shttp: HTTP request too long");
+            shttp_write_response(shttp_empty_response(shttpStatusPayloadTooLarge), connection, false, false);
+            return false;
+        }
+
+        uint32_t size = (state->bodySize > 0) ? state->bodySize : SHTTP_CHUNKED_BODY_SIZE;
+        while (size < needed) {
+            size *= 2;
+        }
+        size = MIN(size, maxBodySize + 1);
+
+        char *body = shttp_arena_grow(&state->arena, (state->bodySize > 0) ? state->request.bodyData : NULL, state->bodySize, size);
+        if (body == NULL) {
+            LOG(ERROR, "shttp: Out of memory while building buffer");
+            return false;
+        }
+        state->request.bodyData = body;
+        state->bodySize = size;
+    }
+
+    memcpy(state->request.bodyData + state->request.bodyLen, data, len);
     state->request.bodyLen += len;
+    state->request.bodyData[state->request.bodyLen] = '\0';
 
-    while(1) {
-        LOG(TRACE, "shttp: parser loop entered, %d bytes left (intro: %d, headers: %d)", state->request.bodyLen, state->introductionFinished, state->headerFinished);
-
-        // check if we are in header or body mode
-        bool lastStateIntro = state->introductionFinished;
-        bool lastStateHeader = state->headerFinished;
-        if ((!state->introductionFinished) || (!state->headerFinished)) {
-            // check if we have a \r\n in the buffer
-            char *data = state->request.bodyData;
-            for (uint16_t i = 0; i < state->request.bodyLen - 1; i++) {
-                if ((data[i] == '\r') && (data[i + 1] == '\n')) {
-
-                    // line break found, try to parse the stuff
-                    if (!state->introductionFinished) {
-                        result = shttp_parse_introduction(state);
-                        break;
-                    }
-                    if (!state->headerFinished) {
-                        result = shttp_parse_headers(state);
-                        break;
-                    }
+    return true;
+}
+
+// a chunk size line is complete, the last chunk has size 0 and is
+// followed by the trailer fields
+static ICACHE_FLASH_ATTR bool shttp_chunk_size_end(shttpParserState *state) {
+    if (state->chunkDigits == 0) {
+        return false;
+    }
+
+    LOG(TRACE, "shttp: parser -> chunk of %d bytes", state->chunkRemaining);
+    state->chunkDigits = 0;
+    if (state->chunkRemaining == 0) {
+        state->trailers = true;
+        state->step = shttpParserStepHeaderStart;
+    } else {
+        state->step = shttpParserStepBody;
+    }
+    return true;
+}
+
+// true if the body is an urlencoded form the route wants as parameters
+static ICACHE_FLASH_ATTR bool shttp_form_body(shttpParserState *state) {
+    if ((state->route == NULL) || (!state->route->formParameters) || (state->request.bodyLen == 0) || (state->contentType == NULL)) {
+        return false;
+    }
+
+    // the media type may be followed by parameters like a charset
+    const char *type = FSTR("application/x-www-form-urlencoded");
+    char *value = state->contentType;
+    while (*type) {
+        if (tolower((unsigned char)*value) != *type) {
+            return false;
+        }
+        value++;
+        type++;
+    }
+    return ((*value == '\0') || (*value == ';') || (*value == ' ') || (*value == '\t'));
+}
+
+// split an urlencoded form body into parameters, names and values are
+// decoded in place as they never get longer
+static ICACHE_FLASH_ATTR bool shttp_parse_form_body(shttpParserState *state) {
+    char *data = state->request.bodyData;
+    char *end = data + state->request.bodyLen;
+
+    while (data < end) {
+        char *pair = data;
+        char *next = memchr(pair, '&', end - pair);
+        if (next == NULL) {
+            next = end;
+        }
+
+        char *value = memchr(pair, '=', next - pair);
+        if (value != NULL) {
+            shttp_url_decode_in_place(value + 1, next - value - 1);
+        } else {
+            value = next;
+        }
+        shttp_url_decode_in_place(pair, value - pair);
+        if (!shttp_add_parameter(state, pair, (value < next) ? value + 1 : shttpEmptyString)) {
+            return false;
+        }
+
+        data = next + 1;
+    }
+
+    LOG(TRACE, "shttp: %d parameters with form body", state->request.numParameters);
+    return true;
+}
+
+// run the route of a complete request, returns false if the connection
+// should be closed
+static ICACHE_FLASH_ATTR bool shttp_finish_request(shttpParserState *state, shttpConnection *connection) {
+    LOG(TRACE, "shttp: parser -> expected body size reached: %d/%d", state->bodyReceived, state->expectedBodySize);
+
+    // close the connection after the last allowed request
+    uint16_t maxRequests = (state->config->maxKeepAliveRequests > 0) ? state->config->maxKeepAliveRequests : SHTTP_MAX_KEEPALIVE_REQUESTS;
+    state->numRequests++;
+    if ((state->numRequests >= maxRequests) || (shttpServerDraining)) {
+        state->keepAlive = false;
+    }
+
+    // a multipart body has to end with the closing delimiter
+    if ((state->multipart != NULL) && (!shttp_multipart_complete(state->multipart))) {
+        LOG(ERROR, "shttp: multipart body ended early");
+        shttp_write_response(shttp_empty_response(shttpStatusBadRequest), connection, false, false);
+        return false;
+    }
+
+    // form fields join the URL parameters before the route runs
+    if ((state->rejection == NULL) && (shttp_form_body(state)) && (!shttp_parse_form_body(state))) {
+        shttp_write_response(shttp_empty_response(shttpStatusBadRequest), connection, false, false);
+        return false;
+    }
+
+    // run the callback, responses are written in request order
+    bool keepAlive;
+    bool headOnly = (state->method == shttpMethodHEAD);
+    if (state->rejection != NULL) {
+        keepAlive = shttp_write_response(state->rejection, connection, state->keepAlive, headOnly);
+    } else {
+        keepAlive = shttp_exec_route(state->route, state->path, &state->request, connection, state->keepAlive, headOnly);
+    }
+    if (!keepAlive) {
+        return false;
+    }
+
+    // connection stays open, prepare for the next request, the netbuf
+    // being parsed may hold the start of a pipelined request
+    LOG(TRACE, "shttp: parser -> keep-alive, request %d finished", state->numRequests);
+    shttp_parser_free_request(state, (connection->pending != NULL));
+    shttp_parser_reset_request(state);
+
+    return true;
+}
+
+// parse one byte of the request line or headers, `at` is its position in
+// the segment. Returns false on a parse error
+static ICACHE_FLASH_ATTR bool shttp_parse_byte(shttpParserState *state, char *at, shttpConnection *connection) {
+    char c = *at;
+
+    switch (state->step) {
+        case shttpParserStepMethod:
+            // ignore empty lines in front of a request
+            if ((state->wordLen == 0) && ((c == '\r') || (c == '\n'))) {
+                return true;
+            }
+            if (state->wordLen == sizeof(state->word) - 1) {
+                return false;
+            }
+            state->word[state->wordLen++] = c;
+            if (c == ' ') {
+                if (shttp_parse_method(state->word, state->wordLen, &state->method) != state->wordLen) {
+                    return false;
                 }
+                LOG(TRACE, "shttp: parser -> method: %d", state->method);
+                state->step = shttpParserStepPath;
             }
-            if (!result) {
-                // parse error
+            break;
+
+        case shttpParserStepPath:
+            if ((c == '?') || (c == ' ')) {
+                state->path = shttp_token_end(state, false);
+                LOG(TRACE, "shttp: parser -> path: '%s'", state->path);
+                state->wordLen = 0;
+                state->step = (c == '?') ? shttpParserStepQueryKey : shttpParserStepVersion;
+            } else if ((c == '\r') || (c == '\n')) {
                 return false;
+            } else {
+                shttp_token_touch(state, at);
+                return shttp_token_put(state, c);
             }
-            if ((lastStateIntro == state->introductionFinished) && (lastStateHeader == state->headerFinished)) {
-                break;
+            break;
+
+        case shttpParserStepQueryKey:
+        case shttpParserStepQueryValue:
+            if ((c == '&') || (c == ' ')) {
+                char *token = shttp_token_end(state, false);
+                bool result;
+                if (state->step == shttpParserStepQueryKey) {
+                    // key without value
+                    result = shttp_add_parameter(state, token, shttpEmptyString);
+                } else {
+                    result = shttp_add_parameter(state, state->name, token);
+                }
+                if (!result) {
+                    return false;
+                }
+                state->step = (c == '&') ? shttpParserStepQueryKey : shttpParserStepVersion;
+            } else if ((c == '=') && (state->step == shttpParserStepQueryKey)) {
+                state->name = shttp_token_end(state, false);
+                state->step = shttpParserStepQueryValue;
+            } else if ((c == '\r') || (c == '\n')) {
+                return false;
+            } else {
+                shttp_token_touch(state, at);
+                return shttp_token_put_encoded(state, c);
             }
-            continue;
-        }
+            break;
+
+        case shttpParserStepVersion:
+            if (c == '\n') {
+                // HTTP/1.1 defaults to persistent connections, HTTP/1.0 does not
+                if ((state->wordLen == 8) && (strncmp(FSTR("HTTP/1.0"), state->word, 8) == 0)) {
+                    state->keepAlive = false;
+                    state->http10 = true;
+                }
 
-        // if headers have finished, check if body size reached
-        if (state->headerFinished) {
-            if (state->request.bodyLen >= state->expectedBodySize) {
-                // yeah we have everything, execute the route
-                LOG(TRACE, "shttp: parser -> expected body size reached: %d/%d", state->request.bodyLen, state->expectedBodySize);
+                // the route decides which headers are stored, running out
+                // of memory is no reason for a 404
+                if (!shttp_match_route(state->config, state->path, state->method, &state->route, &state->allowed, &state->request)) {
+                    shttp_write_response(shttp_empty_response(shttpStatusInternalError), connection, false, false);
+                    return false;
+                }
+                state->capture = shttp_route_capture(state->config, state->route);
+                state->step = shttpParserStepHeaderStart;
+            } else if ((c != '\r') && (state->wordLen < sizeof(state->word) - 1)) {
+                state->word[state->wordLen++] = c;
+            }
+            break;
 
-                // run the callback
-                shttp_exec_route(state->path, state->method, &state->request, conn);
+        case shttpParserStepHeaderStart:
+            if (c == '\n') {
+                // empty line, end of header block or of the trailers
+                if (state->trailers) {
+                    state->step = shttpParserStepComplete;
+                    return true;
+                }
+                return shttp_start_body(state, connection);
+            }
+            if (c == '\r') {
+                break;
+            }
+            if (c == ':') {
+                // Only a value without a key? Parse error!
+                return false;
+            }
+            state->step = shttpParserStepHeaderName;
+            // fall through
 
-                // we operate in 'Connection: close' mode always
+        case shttpParserStepHeaderName:
+            if (c == ':') {
+                bool holdCurrent = state->holdCurrent;
+                state->name = shttp_token_end(state, true);
+                if (shttp_capture_header(state, state->name)) {
+                    state->step = shttpParserStepHeaderValueStart;
+                } else {
+                    // neither the header nor the data it is in is needed
+                    LOG(TRACE, "shttp: parser -> skipping header '%s'", state->name);
+                    state->holdCurrent = holdCurrent;
+                    state->step = shttpParserStepHeaderSkip;
+                }
+            } else if ((c == '\r') || (c == '\n')) {
+                // Only a key without a value? Parse error!
                 return false;
+            } else {
+                shttp_token_touch(state, at);
+                return shttp_token_put(state, tolower((unsigned char)c));
             }
-            LOG(TRACE, "shttp: parser -> waiting for more data");
             break;
-        } else {
-            if (state->request.bodyLen < 5) {
-                LOG(TRACE, "shttp: parser -> waiting for more data, headers not finished");
+
+        case shttpParserStepHeaderValueStart:
+            if ((c == ' ') || (c == '\t') || (c == '\r')) {
                 break;
             }
+            state->step = shttpParserStepHeaderValue;
+            // fall through
+
+        case shttpParserStepHeaderValue:
+            if (c == '\n') {
+                if (!shttp_add_header(state, state->name, shttp_token_end(state, true))) {
+                    return false;
+                }
+                state->step = shttpParserStepHeaderStart;
+            } else if (c != '\r') {
+                shttp_token_touch(state, at);
+                return shttp_token_put(state, c);
+            }
+            break;
+
+        case shttpParserStepHeaderSkip:
+            if (c == '\n') {
+                state->step = shttpParserStepHeaderStart;
+            }
+            break;
+
+        case shttpParserStepChunkSize: {
+            int8_t digit = shttp_hex_value(c);
+            if (digit >= 0) {
+                // the size has to fit 32 bits, leading zeros do not count
+                if (state->chunkRemaining == 0) {
+                    state->chunkDigits = 0;
+                }
+                if (state->chunkDigits == 2 * sizeof(state->chunkRemaining)) {
+                    LOG(ERROR, "shttp: chunk too large");
+                    shttp_write_response(shttp_empty_response(shttpStatusPayloadTooLarge), connection, false, false);
+                    return false;
+                }
+                state->chunkRemaining = (state->chunkRemaining << 4) | digit;
+                state->chunkDigits++;
+            } else if (c == ';') {
+                state->step = shttpParserStepChunkExtension;
+            } else if ((c == '\n') && (shttp_chunk_size_end(state))) {
+                break;
+            } else if ((c == '\n') || ((c != '\r') && (c != ' ') && (c != '\t'))) {
+                LOG(ERROR, "shttp: invalid chunk size");
+                shttp_write_response(shttp_empty_response(shttpStatusBadRequest), connection, false, false);
+                return false;
+            }
+            break;
         }
+
+        case shttpParserStepChunkExtension:
+            // extensions are ignored
+            if ((c == '\n') && (!shttp_chunk_size_end(state))) {
+                LOG(ERROR, "shttp: invalid chunk size");
+                shttp_write_response(shttp_empty_response(shttpStatusBadRequest), connection, false, false);
+                return false;
+            }
+            break;
+
+        case shttpParserStepChunkEnd:
+            // line break after the chunk data
+            if (c == '\n') {
+                state->step = shttpParserStepChunkSize;
+            } else if (c != '\r') {
+                LOG(ERROR, "shttp: chunk data too long");
+                shttp_write_response(shttp_empty_response(shttpStatusBadRequest), connection, false, false);
+                return false;
+            }
+            break;
+
+        default:
+            break;
     }
 
-    // await more data
     return true;
 }
 
-ICACHE_FLASH_ATTR void shttp_destroy_parser(shttpParserState *state) {
-    LOG(TRACE, "shttp: parser -> destroy");
+// delimiters of the steps collecting tokens, the bytes in between are
+// taken as one run
+static const char shttpPathDelimiters[] = { '?', ' ', '\r', '\n' };
+static const char shttpQueryDelimiters[] = { '&', '=', ' ', '%', '+', '\r', '\n' };
+static const char shttpNameDelimiters[] = { ':', '\r', '\n' };
+static const char shttpValueDelimiters[] = { '\r', '\n' };
+
+// take the bytes up to the next delimiter of the current step at once,
+// returns the number of bytes taken or -1 if out of memory
+static ICACHE_FLASH_ATTR int32_t shttp_parse_run(shttpParserState *state, char *data, uint16_t len) {
+    const char *set;
+    uint8_t num;
+
+    switch (state->step) {
+        case shttpParserStepPath:
+            set = shttpPathDelimiters;
+            num = sizeof(shttpPathDelimiters);
+            break;
+        case shttpParserStepQueryKey:
+        case shttpParserStepQueryValue:
+            // an escape sequence is finished byte by byte
+            if (state->decodeStep != 0) {
+                return 0;
+            }
+            set = shttpQueryDelimiters;
+            num = sizeof(shttpQueryDelimiters);
+            break;
+        case shttpParserStepHeaderName:
+            set = shttpNameDelimiters;
+            num = sizeof(shttpNameDelimiters);
+            break;
+        case shttpParserStepHeaderValue:
+            set = shttpValueDelimiters;
+            num = sizeof(shttpValueDelimiters);
+            break;
+        case shttpParserStepHeaderSkip:
+            set = shttpValueDelimiters + 1;
+            num = 1;
+            break;
+        default:
+            return 0;
+    }
+
+    uint16_t run = shttp_scan_any(data, len, set, num);
+    if ((run == 0) || (state->step == shttpParserStepHeaderSkip)) {
+        return run;
+    }
 
-    // free headers
-    if (state->request.headers != NULL) {
-        for(uint8_t i = 0; i < state->request.numHeaders; i++) {
-            free(state->request.headers[i].name);
-            free(state->request.headers[i].value);
+    char *written = shttp_token_run(state, data, run);
+    if (written == NULL) {
+        return -1;
+    }
+    if (state->step == shttpParserStepHeaderName) {
+        for (uint16_t i = 0; i < run; i++) {
+            written[i] = tolower((unsigned char)written[i]);
         }
-        free(state->request.headers);
     }
+    return run;
+}
+
+// parse one received segment, returns false if the connection should be
+// closed
+static ICACHE_FLASH_ATTR bool shttp_parse_segment(shttpParserState *state, char *data, uint16_t len, shttpConnection *connection) {
+    uint16_t i = 0;
+
+    while (i < len) {
+        if (state->step == shttpParserStepBody) {
+            // body data, for a chunked body up to the end of the chunk
+            uint32_t remaining = (state->chunked) ? state->chunkRemaining : state->expectedBodySize - state->bodyReceived;
+            uint16_t bodyPart = MIN(len - i, remaining);
+            if (shttp_parser_streaming(state)) {
+                // the size of a chunked body is only known when it is over
+                if (state->bodyReceived + bodyPart > shttp_max_body_size(state)) {
+                    LOG(ERROR, "shttp: HTTP request too long");
+                    shttp_write_response(shttp_empty_response(shttpStatusPayloadTooLarge), connection, false, false);
+                    return false;
+                }
 
-    // free parameters
-    if (state->request.parameters != NULL) {
-        for(uint8_t i = 0; i < state->request.numParameters; i++) {
-            free(state->request.parameters[i].name);
-            free(state->request.parameters[i].value);
+                // hand the data to the route right from the received buffer,
+                // a multipart body is split into its parts on the way
+                if ((bodyPart > 0) && (state->multipart != NULL)) {
+                    if (!shttp_multipart_parse(state->multipart, data + i, bodyPart)) {
+                        shttpStatusCode status = (shttp_multipart_malformed(state->multipart)) ? shttpStatusBadRequest : shttpStatusInternalError;
+                        shttp_write_response(shttp_empty_response(status), connection, false, false);
+                        return false;
+                    }
+                } else if ((bodyPart > 0) && (!shttp_stream_route(state->route, &state->request, data + i, bodyPart))) {
+                    LOG(ERROR, "shttp: body callback aborted the request");
+                    shttp_write_response(shttp_empty_response(shttpStatusInternalError), connection, false, false);
+                    return false;
+                }
+            } else if ((bodyPart > 0) && (!shttp_append_body(state, data + i, bodyPart, connection))) {
+                return false;
+            }
+            state->bodyReceived += bodyPart;
+            i += bodyPart;
+
+            if (state->chunked) {
+                state->chunkRemaining -= bodyPart;
+                if (state->chunkRemaining == 0) {
+                    state->step = shttpParserStepChunkEnd;
+                }
+            }
+        } else {
+            // every byte of request line, headers and chunk framing is
+            // looked at once, the parser resumes where it stopped with the
+            // next segment
+            while ((i < len) && (state->step != shttpParserStepBody) && (state->step != shttpParserStepComplete)) {
+                // runs of token bytes are taken at once, delimiters and
+                // everything else byte by byte
+                int32_t run = shttp_parse_run(state, data + i, len - i);
+                uint16_t count = run;
+                if (run < 0) {
+                    return false;
+                } else if (run == 0) {
+                    // chunk framing does not count against the header size
+                    count = ((state->step < shttpParserStepBody) && ((state->step != shttpParserStepMethod) || (state->wordLen > 0) || ((data[i] != '\r') && (data[i] != '\n')))) ? 1 : 0;
+                }
+
+                if (state->headerSize + count > SHTTP_MAX_HEADER_SIZE) {
+                    LOG(ERROR, "shttp: HTTP request too long");
+                    shttp_write_response(shttp_empty_response(shttpStatusBadRequest), connection, false, false);
+                    return false;
+                }
+                state->headerSize += count;
+
+                if (run > 0) {
+                    i += run;
+                } else if (!shttp_parse_byte(state, data + i, connection)) {
+                    // parse error
+                    return false;
+                } else {
+                    i++;
+                }
+            }
+        }
+
+        if ((state->step == shttpParserStepComplete) ||
+            ((state->step == shttpParserStepBody) && (!state->chunked) && (state->bodyReceived >= state->expectedBodySize))) {
+            // yeah we have everything, execute the route, anything behind
+            // the body is the start of the next pipelined request
+            if (!shttp_finish_request(state, connection)) {
+                return false;
+            }
         }
-        free(state->request.parameters);
     }
 
-    // free path parameters
-    if (state->request.pathParameters != NULL) {
-        for(uint8_t i = 0; i < state->request.numPathParameters; i++) {
-            free(state->request.pathParameters[i]);
+    // the segment ends in the middle of a token
+    return shttp_token_carry(state);
+}
+
+//
+// API
+//
+
+ICACHE_FLASH_ATTR shttpParserState *shttp_parser_init_state(shttpConfig *config) {
+    // the state and the initial arena block are one allocation
+    uint16_t arenaSize = (config->arenaSize > 0) ? config->arenaSize : SHTTP_ARENA_SIZE;
+    shttpParserState *result = malloc(sizeof(shttpParserState) + SHTTP_ARENA_BLOCK_SIZE(arenaSize));
+    if (result == NULL) {
+        return NULL;
+    }
+
+    result->config = config;
+    shttp_arena_init(&result->arena, result + 1, arenaSize);
+    result->request.arena = &result->arena;
+    result->numRequests = 0;
+
+    shttp_parser_reset_request(result);
+
+    return result;
+}
+
+ICACHE_FLASH_ATTR bool shttp_parse(shttpParserState *state, struct netbuf *inbuf, shttpConnection *connection) {
+    bool result = true;
+    char *data;
+    uint16_t len;
+
+    // run parser on every part of the buffer
+    state->holdCurrent = false;
+    do {
+        netbuf_data(inbuf, (void **)&data, &len);
+        LOG(TRACE, "shttp: received %d bytes", len);
+        result = shttp_parse_segment(state, data, len, connection);
+    } while ((result) && (netbuf_next(inbuf) >= 0));
+
+    // keep the netbuf as long as the request points into it
+    if (state->holdCurrent) {
+        if (state->held == NULL) {
+            state->held = inbuf;
+        } else {
+            netbuf_chain(state->held, inbuf);
         }
-        free(state->request.pathParameters);
+    } else {
+        netbuf_delete(inbuf);
     }
 
-    // free internal buffer
-    if (state->request.bodyData) {
-        free(state->request.bodyData);
+    return result;
+}
+
+ICACHE_FLASH_ATTR shttpParserPhase shttp_parser_phase(shttpParserState *state) {
+    if ((state->step >= shttpParserStepBody) || (state->trailers)) {
+        return (shttp_parser_streaming(state)) ? shttpParserPhaseStream : shttpParserPhaseBody;
+    }
+    if (state->headerSize > 0) {
+        return shttpParserPhaseHeaders;
     }
+    return shttpParserPhaseIdle;
+}
 
-    // free path
-    if (state->path) {
-        free(state->path);
+ICACHE_FLASH_ATTR char *shttp_request_parameter(shttpRequest *request, char *name) {
+    for (uint8_t i = 0; i < request->numParameters; i++) {
+        if (strcmp(request->parameters[i].name, name) == 0) {
+            return request->parameters[i].value;
+        }
     }
+    return NULL;
+}
 
-    // free state object
+ICACHE_FLASH_ATTR void shttp_destroy_parser(shttpParserState *state) {
+    LOG(TRACE, "shttp: parser -> destroy");
+
+    shttp_parser_free_request(state, false);
+    shttp_arena_destroy(&state->arena);
+
+    // free state object, the initial arena block is part of it
     free(state);
-}
\ No newline at end of file
+}
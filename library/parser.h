@@ -2,11 +2,27 @@
 #define shttp_parser_h_included
 
 #include "simplehttp/http.h"
+#include "response.h"
 
 typedef struct _shttpParserState shttpParserState;
 
-shttpParserState *shttp_parser_init_state(void);
-bool shttp_parse(shttpParserState *state, char *buffer, uint16_t len, struct netconn *conn);
+// what the parser is waiting for, used to apply the matching timeout
+typedef enum _shttpParserPhase {
+    shttpParserPhaseIdle,     // no data of the next request received yet
+    shttpParserPhaseHeaders,  // request line and headers
+    shttpParserPhaseBody,     // request body
+    shttpParserPhaseStream    // streamed request body, timeout per chunk
+} shttpParserPhase;
+
+// parse the method at the start of a request line, returns the length of
+// the method including the trailing space or 0 if unknown
+uint16_t shttp_parse_method(char *data, uint16_t len, shttpMethod *method);
+
+shttpParserState *shttp_parser_init_state(shttpConfig *config);
+// parse received data, the parser takes ownership of `inbuf`. Returns
+// false if the connection should be closed
+bool shttp_parse(shttpParserState *state, struct netbuf *inbuf, shttpConnection *connection);
 void shttp_destroy_parser(shttpParserState *state);
+shttpParserPhase shttp_parser_phase(shttpParserState *state);
 
 #endif /* shttp_parser_h_included */
\ No newline at end of file
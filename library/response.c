@@ -7,98 +7,183 @@
 #include <sys/types.h>
 #include <unistd.h>
 
-#include "debug.h"
-
-ICACHE_FLASH_ATTR void shttp_write_response(shttpResponse *response, struct netconn *conn) {
-    err_t err;
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 
-    const char *responseIntro = NULL;
-    switch(response->responseCode) {
+#include "debug.h"
+#include "response.h"
+
+typedef enum _shttpWriterPhase {
+    shttpWriterPhaseHead,
+    shttpWriterPhaseBody,
+    shttpWriterPhaseStream,
+    shttpWriterPhaseDone
+} shttpWriterPhase;
+
+// resumable state of a response being written to a connection
+typedef struct _shttpResponseWriter {
+    shttpResponse *response;
+    shttpWriterPhase phase;
+    bool keepAlive;
+
+    // serialized status line and headers, followed by the body if it
+    // was small enough
+    char *head;
+    bool bodyIncluded;
+
+    // the body is announced but not sent
+    bool skipBody;
+
+    // data that has still to be written for the current phase
+    const char *data;
+    uint32_t dataLen;
+
+    // chunk returned by the body callback and bytes streamed so far
+    char *chunk;
+    uint32_t position;
+
+    uint32_t contentLength;
+    portTickType lastProgress;
+
+    // next response queued on the same connection
+    struct _shttpResponseWriter *next;
+} shttpResponseWriter;
+
+ICACHE_FLASH_ATTR static const char *shttp_status_text(shttpStatusCode status) {
+    switch(status) {
         case shttpStatusOK:
-            responseIntro = FSTR("200 Ok");
-            break;
+            return FSTR("200 Ok");
         case shttpStatusCreated:
-            responseIntro = FSTR("201 Created");
-            break;
+            return FSTR("201 Created");
         case shttpStatusAccepted:
-            responseIntro = FSTR("202 Accepted");
-            break;
+            return FSTR("202 Accepted");
         case shttpStatusNoContent:
-            responseIntro = FSTR("204 No content");
-            break;
+            return FSTR("204 No content");
 
         case shttpStatusMovedPermanently:
-            responseIntro = FSTR("301 Redirect");
-            break;
+            return FSTR("301 Redirect");
         case shttpStatusFound:
-            responseIntro = FSTR("302 Found");
-            break;
+            return FSTR("302 Found");
         case shttpStatusNotModified:
-            responseIntro = FSTR("304 Not modified");
-            break;
+            return FSTR("304 Not modified");
 
         case shttpStatusBadRequest:
-            responseIntro = FSTR("400 Bad request");
-            break;
+            return FSTR("400 Bad request");
         case shttpStatusUnauthorized:
-            responseIntro = FSTR("401 Unauthorized");
-            break;
+            return FSTR("401 Unauthorized");
         case shttpStatusForbidden:
-            responseIntro = FSTR("403 Forbidden");
-            break;
+            return FSTR("403 Forbidden");
         case shttpStatusNotFound:
-            responseIntro = FSTR("404 Not found");
-            break;
+            return FSTR("404 Not found");
+        case shttpStatusNotAllowed:
+            return FSTR("405 Method not allowed");
         case shttpStatusNotAcceptable:
-            responseIntro = FSTR("406 Not acceptable");
-            break;
+            return FSTR("406 Not acceptable");
+        case shttpStatusRequestTimeout:
+            return FSTR("408 Request timeout");
         case shttpStatusConflict:
-            responseIntro = FSTR("409 Conflict");
-            break;
+            return FSTR("409 Conflict");
+        case shttpStatusPayloadTooLarge:
+            return FSTR("413 Payload too large");
         case shttpStatusRequestURITooLong:
-            responseIntro = FSTR("414 Request URI too long");
-            break;
+            return FSTR("414 Request URI too long");
 
         case shttpStatusInternalError:
-            responseIntro = FSTR("500 Internal server error");
-            break;
+            return FSTR("500 Internal server error");
         case shttpStatusNotImplemented:
-            responseIntro = FSTR("501 Not implemented");
-            break;
+            return FSTR("501 Not implemented");
         case shttpStatusBadGateway:
-            responseIntro = FSTR("502 Bad gateway");
-            break;
+            return FSTR("502 Bad gateway");
         case shttpStatusServiceUnavailable:
-            responseIntro = FSTR("503 Service unavailable");
-            break;
+            return FSTR("503 Service unavailable");
     }
 
-    LOG(TRACE, "shttp: sending response '%s'", responseIntro);
 
-    // send status line
-    netconn_write(conn, FSTR("HTTP/1.1 "), 9, NETCONN_NOCOPY);
-    netconn_write(conn, responseIntro, strlen(responseIntro), NETCONN_NOCOPY);
-    netconn_write(conn, FSTR("\r\n"), 2, NETCONN_NOCOPY);
+    return FSTR("500 Internal server error");
+}
 
-    // if there are any headers send them first
+ICACHE_FLASH_ATTR static void shttp_free_response(shttpResponse *response) {
     if (response->headerCount > 0) {
         for(uint8_t i = 0; i < response->headerCount; i++) {
-            shttpHeader *header = &(response->headers[i]);
-            LOG(TRACE, "shttp: sending header '%s: %s' (%d and %d bytes)", header->name, header->value, strlen(header->name), strlen(header->value));
-
-            netconn_write(conn, header->name, strlen(header->name), NETCONN_COPY);
-            netconn_write(conn, FSTR(": "), 2, NETCONN_NOCOPY);
-            netconn_write(conn, header->value, strlen(header->value), NETCONN_COPY);
-            netconn_write(conn, FSTR("\r\n"), 2, NETCONN_NOCOPY);
-        
-            free(header->name);
-            free(header->value);
+            free(response->headers[i].name);
+            free(response->headers[i].value);
         }
         free(response->headers);
     }
-    // Send a connection close header as we close the connection anyway
+    if ((response->body) && (response->free_body)) {
+        free(response->body);
+    }
+    free(response);
+}
 
-    netconn_write(conn, FSTR("Connection: close\r\n"), 19, NETCONN_NOCOPY);
+// serialize status line and headers into one buffer, so the head can be
+// written in pieces whenever the client accepts more data. A body that
+// fits into SHTTP_COALESCE_SIZE with the head is appended unless `skipBody`
+// is set, `bodyIncluded` is set then
+ICACHE_FLASH_ATTR static char *shttp_build_head(shttpResponse *response, const char *responseIntro, bool keepAlive, bool sendContentLength, uint32_t contentLength, bool skipBody, uint32_t *len, bool *bodyIncluded) {
+    // measure
+    uint32_t headLen = 9 + strlen(responseIntro) + 2;
+    for(uint8_t i = 0; i < response->headerCount; i++) {
+        headLen += strlen(response->headers[i].name) + 2 + strlen(response->headers[i].value) + 2;
+    }
+    headLen += (keepAlive) ? 24 : 19;
+    if (sendContentLength) {
+        headLen += 16 + 10 + 2; // max 4 GB
+    }
+    headLen += 2;
+
+    // the measured length is an upper bound, so this never overshoots
+    *bodyIncluded = ((response->body) && (!skipBody) && (!response->bodyCallback) && (headLen + contentLength <= SHTTP_COALESCE_SIZE));
+
+    char *head = malloc(headLen + ((*bodyIncluded) ? contentLength : 0) + 1);
+    if (head == NULL) {
+        return NULL;
+    }
+
+    // status line
+    char *ptr = head;
+    ptr += sprintf(ptr, FSTR("HTTP/1.1 %s\r\n"), responseIntro);
+
+    // headers set by the route
+    for(uint8_t i = 0; i < response->headerCount; i++) {
+        shttpHeader *header = &(response->headers[i]);
+        LOG(TRACE, "shttp: sending header '%s: %s'", header->name, header->value);
+        ptr += sprintf(ptr, FSTR("%s: %s\r\n"), header->name, header->value);
+    }
+
+    // tell the client if the connection will be re-used
+    if (keepAlive) {
+        memcpy(ptr, FSTR("Connection: keep-alive\r\n"), 24);
+        ptr += 24;
+    } else {
+        memcpy(ptr, FSTR("Connection: close\r\n"), 19);
+        ptr += 19;
+    }
+
+    if (sendContentLength) {
+        ptr += sprintf(ptr, FSTR("Content-Length: %u\r\n"), contentLength);
+    }
+
+    // finish header block
+    memcpy(ptr, FSTR("\r\n"), 2);
+    ptr += 2;
+
+    if (*bodyIncluded) {
+        memcpy(ptr, response->body, contentLength);
+        ptr += contentLength;
+    }
+
+    *len = ptr - head;
+    return head;
+}
+
+ICACHE_FLASH_ATTR static shttpResponseWriter *shttp_writer_create(shttpResponse *response, bool keepAlive, bool headOnly) {
+    const char *responseIntro = shttp_status_text(response->responseCode);
+    LOG(TRACE, "shttp: sending response '%s'", responseIntro);
+
+    // a response to a HEAD request announces the body without sending it,
+    // 204 and 304 never have a body
+    bool skipBody = ((headOnly) || (response->responseCode == shttpStatusNoContent) || (response->responseCode == shttpStatusNotModified));
 
     // if we know the body length add a content-length header
     uint32_t contentLength = 0;
@@ -108,58 +193,259 @@ ICACHE_FLASH_ATTR void shttp_write_response(shttpResponse *response, struct netc
     }
     if (response->bodyCallback) {
         contentLength = (response->bodyLen > 0) ? response->bodyLen : 0;
+
+        // a streaming body of unknown length is only delimited by closing
+        // the connection
+        if ((contentLength == 0) && (!skipBody)) {
+            keepAlive = false;
+        }
+    }
+
+    // the client needs the content length to find the end of the body
+    // when the connection stays open, 204 and 304 never have a body
+    bool sendContentLength = (contentLength > 0);
+    if ((keepAlive) && (response->responseCode != shttpStatusNoContent) && (response->responseCode != shttpStatusNotModified)) {
+        sendContentLength = true;
     }
-    if (contentLength > 0) {
-        char *tmp = malloc(18 + 8); // max 99 MB
-        sprintf(tmp, FSTR("Content-Length: %d\r\n"), contentLength);
-        netconn_write(conn, tmp, strlen(tmp), NETCONN_COPY);
-        free(tmp);
+    if (response->responseCode == shttpStatusNoContent) {
+        sendContentLength = false;
     }
 
     LOG(TRACE, "shttp: content length: %d", contentLength);
 
-    // finish header block
-    netconn_write(conn, FSTR("\r\n"), 2, NETCONN_NOCOPY);
+    shttpResponseWriter *writer = malloc(sizeof(shttpResponseWriter));
+    if (writer == NULL) {
+        LOG(ERROR, "shttp: Out of memory while creating response writer");
+        shttp_free_response(response);
+        return NULL;
+    }
 
-    // send body
-    if (response->body) {
-        // body data available, direct send
-        LOG(TRACE, "shttp: sending body data (%s)", response->body);
-        netconn_write(conn, response->body, contentLength, NETCONN_COPY);
-        if (response->free_body) {
-            free(response->body);
-        }
+    uint32_t headLen;
+    writer->head = shttp_build_head(response, responseIntro, keepAlive, sendContentLength, contentLength, skipBody, &headLen, &writer->bodyIncluded);
+    if (writer->head == NULL) {
+        LOG(ERROR, "shttp: Out of memory while building response head");
+        shttp_free_response(response);
+        free(writer);
+        return NULL;
     }
-    if (response->bodyCallback) {
-        // callback option, repeatedly call callback and stream out data
-        LOG(TRACE, "shttp: sending streaming body data");
-
-        uint32_t position = 0;
-        uint32_t chunkLen = 0;
-        while (1) {
-            char *chunk = response->bodyCallback(position, &chunkLen, response->callbackUserData);
-            if (!chunk) {
-                // if chunk is NULL, callback is finished, clean up
-                LOG(TRACE, "shttp: body chunk stream finished");
-                response->cleanupCallback(response->callbackUserData);
+
+    writer->response = response;
+    writer->phase = shttpWriterPhaseHead;
+    writer->keepAlive = keepAlive;
+    writer->skipBody = skipBody;
+    writer->data = writer->head;
+    writer->dataLen = headLen;
+    writer->chunk = NULL;
+    writer->position = 0;
+    writer->contentLength = contentLength;
+    writer->lastProgress = xTaskGetTickCount();
+    writer->next = NULL;
+
+    return writer;
+}
+
+ICACHE_FLASH_ATTR static void shttp_writer_destroy(shttpResponseWriter *writer) {
+    if (writer->head) {
+        free(writer->head);
+    }
+    if (writer->chunk) {
+        free(writer->chunk);
+    }
+
+    // clean up user data, either finished or errored out
+    if ((writer->response->bodyCallback) && (writer->response->cleanupCallback)) {
+        writer->response->cleanupCallback(writer->response->callbackUserData);
+    }
+
+    shttp_free_response(writer->response);
+    free(writer);
+}
+
+// write as much of the response as the connection accepts, without
+// `blocking` only what fits into the send buffer right now. Blocking
+// writes wait up to the send timeout of the connection
+ICACHE_FLASH_ATTR static shttpWriteResult shttp_writer_write(shttpResponseWriter *writer, struct netconn *conn, bool blocking) {
+    while (1) {
+        // finish the current piece
+        while (writer->dataLen > 0) {
+            size_t written = 0;
+            err_t err = netconn_write_partly(conn, writer->data, writer->dataLen, NETCONN_COPY | ((blocking) ? 0 : NETCONN_DONTBLOCK), &written);
+            if ((err != ERR_OK) && (err != ERR_WOULDBLOCK)) {
+                // Network disconnected, cancel sending data
+                return shttpWriteError;
+            }
+            if (written == 0) {
+                return shttpWritePending;
+            }
+            writer->data += written;
+            writer->dataLen -= written;
+            writer->lastProgress = xTaskGetTickCount();
+        }
+
+        // move on to the next piece
+        shttpResponse *response = writer->response;
+        switch (writer->phase) {
+            case shttpWriterPhaseHead:
+                free(writer->head);
+                writer->head = NULL;
+
+                if (writer->skipBody) {
+                    writer->phase = shttpWriterPhaseDone;
+                    break;
+                }
+                if ((response->body) && (!writer->bodyIncluded)) {
+                    // body data available, direct send
+                    writer->phase = shttpWriterPhaseBody;
+                    writer->data = response->body;
+                    writer->dataLen = writer->contentLength;
+                    break;
+                }
+                // fall through
+            case shttpWriterPhaseBody:
+                if (response->bodyCallback) {
+                    // callback option, repeatedly call callback and stream out data
+                    LOG(TRACE, "shttp: sending streaming body data");
+                    writer->phase = shttpWriterPhaseStream;
+                } else {
+                    writer->phase = shttpWriterPhaseDone;
+                }
+                break;
+            case shttpWriterPhaseStream: {
+                if (writer->chunk) {
+                    free(writer->chunk);
+                }
+
+                uint32_t chunkLen = 0;
+                writer->chunk = response->bodyCallback(writer->position, &chunkLen, response->callbackUserData);
+                if (!writer->chunk) {
+                    // if chunk is NULL, callback is finished
+                    LOG(TRACE, "shttp: body chunk stream finished");
+                    writer->phase = shttpWriterPhaseDone;
+                    break;
+                }
+                LOG(TRACE, "shttp: body chunk %d bytes @ %d", chunkLen, writer->position);
+
+                writer->data = writer->chunk;
+                writer->dataLen = chunkLen;
+                writer->position += chunkLen;
                 break;
             }
-            LOG(TRACE, "shttp: body chunk %d bytes @ %d", chunkLen, position);
+            case shttpWriterPhaseDone:
+                return shttpWriteDone;
+        }
+    }
+}
 
-            // send the chunk and free the memory
-            err = netconn_write(conn, chunk, chunkLen, NETCONN_COPY);
-            free(chunk);
+// true if the client did not accept any data for the configured write timeout
+ICACHE_FLASH_ATTR static bool shttp_writer_stalled(shttpResponseWriter *writer, shttpConfig *config) {
+    uint32_t writeTimeout = (config->writeTimeout > 0) ? config->writeTimeout : SHTTP_WRITE_TIMEOUT;
+    if ((xTaskGetTickCount() - writer->lastProgress) * portTICK_RATE_MS >= writeTimeout) {
+        LOG(DEBUG, "shttp: write stalled for %d ms, giving up", writeTimeout);
+        return true;
+    }
+    return false;
+}
 
-            // increment position
-            position += chunkLen;
+ICACHE_FLASH_ATTR bool shttp_write_response(shttpResponse *response, shttpConnection *connection, bool keepAlive, bool headOnly) {
+    shttpResponseWriter *writer = shttp_writer_create(response, keepAlive, headOnly);
+    if (writer == NULL) {
+        return false;
+    }
+    keepAlive = writer->keepAlive;
+
+    if (connection->nonBlocking) {
+        // queue behind earlier responses, the owner of the connection
+        // flushes the queue whenever the client accepts more data
+        shttpResponseWriter **tail = &connection->pending;
+        while (*tail) {
+            tail = &(*tail)->next;
+        }
+        *tail = writer;
 
-            if (err != ERR_OK) {
-                return; // Network disconnected, cancel sending data
-            }
+        if (shttp_connection_flush(connection) == shttpWriteError) {
+            return false;
+        }
+        return keepAlive;
+    }
+
+#if LWIP_SO_SNDTIMEO
+    // the task blocks in lwIP, a write that makes no progress within the
+    // send timeout set by the data processing task returns nothing written
+    shttpWriteResult result = shttp_writer_write(writer, connection->conn, true);
+    if (result == shttpWritePending) {
+        LOG(DEBUG, "shttp: write stalled, giving up");
+        result = shttpWriteError;
+    }
+#else
+    // without a send timeout a blocking write may never return, poll
+    // until the write timeout instead
+    shttpWriteResult result;
+    while ((result = shttp_writer_write(writer, connection->conn, false)) == shttpWritePending) {
+        if (shttp_writer_stalled(writer, connection->config)) {
+            result = shttpWriteError;
+            break;
         }
+        vTaskDelay(1);
+    }
+#endif
+    shttp_writer_destroy(writer);
+
+    return (result == shttpWriteDone) && (keepAlive);
+}
+
+ICACHE_FLASH_ATTR shttpWriteResult shttp_connection_flush(shttpConnection *connection) {
+    while (connection->pending) {
+        shttpResponseWriter *writer = connection->pending;
+
+        shttpWriteResult result = shttp_writer_write(writer, connection->conn, false);
+        if (result == shttpWritePending) {
+            return shttp_writer_stalled(writer, connection->config) ? shttpWriteError : shttpWritePending;
+        }
+        if (result == shttpWriteError) {
+            return shttpWriteError;
+        }
+
+        connection->pending = writer->next;
+        shttp_writer_destroy(writer);
+    }
+
+    return shttpWriteDone;
+}
+
+ICACHE_FLASH_ATTR void shttp_connection_discard(shttpConnection *connection) {
+    while (connection->pending) {
+        shttpResponseWriter *writer = connection->pending;
+        connection->pending = writer->next;
+        shttp_writer_destroy(writer);
     }
 }
 
+ICACHE_FLASH_ATTR void shttp_write_service_unavailable(struct netconn *conn, uint16_t retryAfter) {
+    char buffer[100];
+
+    // used when we are out of resources, so build it on the stack
+    int len = sprintf(buffer, FSTR("HTTP/1.1 503 Service unavailable\r\nRetry-After: %d\r\nConnection: close\r\nContent-Length: 0\r\n\r\n"), retryAfter);
+
+    // the accepting task may never wait for a client, the response fits
+    // into an empty send buffer anyway
+    size_t written;
+    netconn_write_partly(conn, buffer, len, NETCONN_COPY | NETCONN_DONTBLOCK, &written);
+}
+
+ICACHE_FLASH_ATTR void shttp_write_continue(shttpConnection *connection) {
+    // interim responses may not overtake final ones, with responses still
+    // queued the client sends the body after its own timeout instead
+    if (connection->pending != NULL) {
+        return;
+    }
+
+    char buffer[32];
+    int len = sprintf(buffer, FSTR("HTTP/1.1 100 Continue\r\n\r\n"));
+
+    size_t written;
+    netconn_write_partly(connection->conn, buffer, len, NETCONN_COPY | ((connection->nonBlocking) ? NETCONN_DONTBLOCK : 0), &written);
+}
+
 //
 // API
 //
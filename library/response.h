@@ -7,6 +7,42 @@
 #include <lwip/arch.h>
 #include <lwip/api.h>
 
-void shttp_write_response(shttpResponse *response, struct netconn *conn);
+typedef struct _shttpResponseWriter shttpResponseWriter;
+
+// a client connection and the responses still waiting to be written to it
+typedef struct _shttpConnection {
+    struct netconn *conn;
+
+    // config of the server that accepted the connection
+    shttpConfig *config;
+
+    // if set responses are queued and written whenever the client accepts
+    // data instead of blocking the calling task
+    bool nonBlocking;
+    shttpResponseWriter *pending;
+} shttpConnection;
+
+typedef enum _shttpWriteResult {
+    shttpWriteDone,
+    shttpWritePending,
+    shttpWriteError
+} shttpWriteResult;
+
+// write the response to the connection and free it, returns true if the
+// connection may be re-used for another request. With `headOnly` set, for
+// a HEAD request, only the head is written
+bool shttp_write_response(shttpResponse *response, shttpConnection *connection, bool keepAlive, bool headOnly);
+
+// continue writing queued responses of a non-blocking connection
+shttpWriteResult shttp_connection_flush(shttpConnection *connection);
+
+// drop all queued responses of a connection
+void shttp_connection_discard(shttpConnection *connection);
+
+// tell a client waiting with `Expect: 100-continue` to send the body
+void shttp_write_continue(shttpConnection *connection);
+
+// write a canned 503 response without allocating a response object
+void shttp_write_service_unavailable(struct netconn *conn, uint16_t retryAfter);
 
 #endif /* shttp_response_h_included */
\ No newline at end of file
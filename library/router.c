@@ -4,153 +4,273 @@
 #include <stdbool.h>
 #include <stdlib.h>
 
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
 #include "debug.h"
+#include "parser.h"
+#include "router.h"
+#include "routetree.h"
 #include "response.h"
 
-extern shttpConfig *shttpServerConfig;
+extern xSemaphoreHandle shttpSerializedRouteLock;
 
-ICACHE_FLASH_ATTR static shttpRoute *shttp_find_route(char *path, shttpMethod method, shttpRequest *request) {
-    uint8_t pathLen = strlen(path);
+ICACHE_FLASH_ATTR static shttpRoute *shttp_find_route(shttpConfig *config, char *path, shttpMethod method, shttpMethod *allowed, shttpRouteParams *params) {
+    uint16_t pathLen = strlen(path);
 
     LOG(TRACE, "shttp: finding route for '%s' (%d chars)", path, pathLen);
 
-    if (shttpServerConfig->appendSlashes) {
+    if ((config->appendSlashes) && (pathLen > 0)) {
         if (path[pathLen - 1] == '/') {
             path[pathLen - 1] = '\0';
             pathLen--;
         }
     }
 
-    uint8_t currentRoute = 0;
-    shttpRoute *route = shttpServerConfig->routes[currentRoute];
-    while(route != NULL) {
-        uint8_t routeLen = strlen(route->path);
-        LOG(TRACE, "shttp: trying route '%s' (%d chars)", route->path, routeLen);
+    return shttp_route_tree_find(config, path, method, allowed, params);
+}
 
-        bool found = true;
-        uint8_t pathIndex = 0, routeIndex = 0;
-        for (; pathIndex < pathLen; pathIndex++) {
-            if (routeIndex >= routeLen) {
-                LOG(TRACE, "shttp: route length reached at %d, pathIndex: %d", routeIndex, pathIndex);
-                found = false;
-                break;
-            }
+ICACHE_FLASH_ATTR bool shttp_priority_request(shttpConfig *config, char *data, uint16_t len) {
+    char path[SHTTP_PRIORITY_PATH_LEN];
+    shttpMethod method;
+    uint16_t i;
 
-            if (route->path[routeIndex] == '?') {
-                LOG(TRACE, "shttp: parameter in route at %d (%d chars left)", routeIndex, pathLen - pathIndex);
-
-                // found parameter, skip path to next slash or end
-                for(uint8_t i = 0; i < pathLen - pathIndex; i++) {
-                    if ((path[pathIndex + i] == '/') || (path[pathIndex + i] == ' ') || (i == pathLen - pathIndex - 1)) {
-                        LOG(TRACE, "shttp: parameter length in path: %d", i + 1);
-                        pathIndex += i;
-                        break;
-                    }
-                }
-
-                routeIndex++;
-                continue;
-            } else if (route->path[routeIndex] == '*') {
-                LOG(TRACE, "shttp: wildcard in route at %d", routeIndex);
-                found = true;
-                routeIndex++;
-                break;
-            } else if (route->path[routeIndex] != path[pathIndex]) {
-                LOG(TRACE, "shttp: mismatch at %d", routeIndex);
-                found = false;
-                break;
-            }
-            routeIndex++;
-        }
+    i = shttp_parse_method(data, len, &method);
+    if (i == 0) {
+        return false;
+    }
 
-        if (routeIndex < routeLen) {
-            found = false;   
+    // copy the path, a request line that is split or too long for the
+    // buffer is queued normally
+    uint16_t pathLen = 0;
+    for(; (i < len) && (data[i] != '?') && (data[i] != ' '); i++) {
+        if (pathLen == sizeof(path) - 1) {
+            return false;
         }
+        path[pathLen++] = data[i];
+    }
+    if (i >= len) {
+        return false;
+    }
+    path[pathLen] = '\0';
 
-        if (found) {
-            // check if the method matches
-            if ((route->allowedMethods & method) != 0) {
-                break;
-            }
+    shttpRoute *route = shttp_find_route(config, path, method, NULL, NULL);
+    return ((route != NULL) && (route->priority));
+}
+
+ICACHE_FLASH_ATTR bool shttp_match_route(shttpConfig *config, char *path, shttpMethod method, shttpRoute **route, shttpMethod *allowed, shttpRequest *request) {
+    *route = NULL;
+    *allowed = 0;
+
+    // the path parameters point into the path, the array also holds the
+    // parameters of the branch being matched
+    shttpRouteParams params = { NULL, 0, NULL, NULL };
+    uint8_t maxParams = (config->routeTree != NULL) ? config->routeTree->maxParams : 0;
+    if (maxParams > 0) {
+        params.values = shttp_request_alloc(request, 2 * maxParams * sizeof(char *));
+        if (params.values == NULL) {
+            LOG(ERROR, "shttp: Out of memory while matching route");
+            return false;
         }
+    }
 
-        currentRoute++;
-        route = shttpServerConfig->routes[currentRoute];
+    *route = shttp_find_route(config, path, method, allowed, (maxParams > 0) ? &params : NULL);
+    LOG(TRACE, "shttp: Route %x, %d URL path parameters", *route, params.num);
+    if ((*route == NULL) || (params.num == 0)) {
+        return true;
     }
 
-    return route;
+    // typed parameters have been checked while matching, they only need
+    // to be converted
+    int32_t *numbers = shttp_request_alloc(request, params.num * sizeof(int32_t));
+    if (numbers == NULL) {
+        LOG(ERROR, "shttp: Out of memory while matching route");
+        *route = NULL;
+        return false;
+    }
+    for (uint8_t i = 0; i < params.num; i++) {
+        numbers[i] = (params.types[i] != shttpRouteParamAny) ? strtol(params.values[i], NULL, 10) : 0;
+    }
+
+    request->pathParameters = params.values;
+    request->numPathParameters = params.num;
+    request->pathParameterNames = params.names;
+    request->pathParameterNumbers = numbers;
+
+    return true;
 }
 
-ICACHE_FLASH_ATTR static void shttp_parse_url_parameters(char *path, shttpRoute *route, shttpRequest *request) {    
-    uint8_t pathLen = strlen(path);
-    uint8_t routeLen = strlen(route->path);
-    for (uint8_t pathIndex = 0, routeIndex = 0; pathIndex < pathLen; pathIndex++) {
-        if (routeIndex >= routeLen) {
-            break;
-        }
+ICACHE_FLASH_ATTR char **shttp_route_capture(shttpConfig *config, shttpRoute *route) {
+    if ((route != NULL) && (route->headers != NULL)) {
+        return route->headers;
+    }
+    return config->headers;
+}
 
-        if (route->path[routeIndex] == '?') {
-            LOG(TRACE, "shttp: parser -> URL path parameter in route at %d", routeIndex);
-
-            // found parameter, find next slash
-            for(uint8_t i = 0; i < pathLen - pathIndex; i++) {
-                if ((path[pathIndex + i] == '/') || (path[pathIndex + i] == ' ') || (i == pathLen - pathIndex - 1)) {
-                    // copy parameter value
-                    char *param = malloc(i + 2);
-                    memcpy(param, path + pathIndex, i + 1);
-                    param[i + 1] = '\0';
-
-                    LOG(TRACE, "shttp: URL path parameter '%s'", param);
-                    // realloc parameter array and append param
-                    request->pathParameters = realloc(request->pathParameters, (request->numPathParameters + 1) * sizeof(char *));
-                    request->pathParameters[request->numPathParameters] = param;
-                    request->numPathParameters++;
-
-                    // skip over the parameter and continue parsing
-                    pathIndex += i;
-                    break;
-                }
-            }
+ICACHE_FLASH_ATTR shttpResponse *shttp_no_route_response(shttpMethod allowed) {
+    // no route for the path at all
+    if (allowed == 0) {
+        LOG(TRACE, "shttp: no route, returning 404");
+        return shttp_empty_response(shttpStatusNotFound);
+    }
 
-            routeIndex++;
-            continue;            
-        } else if (route->path[routeIndex] == '*') {
-            break;
+    // the path exists, but not for this method
+    static const char *names[] = { "GET", "POST", "PUT", "PATCH", "DELETE", "OPTIONS", "HEAD" };
+    char allow[48] = "";
+    for (uint8_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if ((allowed & (1 << i)) != 0) {
+            if (allow[0] != '\0') {
+                strcat(allow, ", ");
+            }
+            strcat(allow, names[i]);
         }
-
-        routeIndex++;
     }
 
+    LOG(TRACE, "shttp: method not allowed, returning 405 (%s)", allow);
+    shttpResponse *response = shttp_empty_response(shttpStatusNotAllowed);
+    shttp_response_add_headers(response, "Allow", allow, NULL);
+    return response;
+}
+
+ICACHE_FLASH_ATTR bool shttp_stream_route(shttpRoute *route, shttpRequest *request, char *data, uint16_t len) {
+    bool result;
+    if (route->serialized) {
+        xSemaphoreTake(shttpSerializedRouteLock, portMAX_DELAY);
+        result = route->bodyCallback(request, data, len);
+        xSemaphoreGive(shttpSerializedRouteLock);
+    } else {
+        result = route->bodyCallback(request, data, len);
+    }
+    return result;
 }
 
-ICACHE_FLASH_ATTR void shttp_exec_route(char *path, shttpMethod method, shttpRequest *request, struct netconn *conn) {
-    // find a route
-    shttpRoute *route = shttp_find_route(path, method, request);
-    LOG(TRACE, "shttp: Route %x", route);
+ICACHE_FLASH_ATTR bool shttp_part_route(shttpRoute *route, shttpRequest *request, shttpPart *part, shttpPartEvent event, char *data, uint16_t len) {
+    bool result;
+    if (route->serialized) {
+        xSemaphoreTake(shttpSerializedRouteLock, portMAX_DELAY);
+        result = route->partCallback(request, part, event, data, len);
+        xSemaphoreGive(shttpSerializedRouteLock);
+    } else {
+        result = route->partCallback(request, part, event, data, len);
+    }
+    return result;
+}
 
+ICACHE_FLASH_ATTR bool shttp_exec_route(shttpRoute *route, char *path, shttpRequest *request, shttpConnection *connection, bool keepAlive, bool headOnly) {
     // no route found return 404
     if (!route) {
         LOG(TRACE, "shttp: no route, returning 404");
-        shttp_write_response(shttp_empty_response(shttpStatusNotFound), conn);
+        return shttp_write_response(shttp_empty_response(shttpStatusNotFound), connection, keepAlive, headOnly);
     }
 
-    // parse url parameters
-    shttp_parse_url_parameters(path, route, request);
-    LOG(TRACE, "shttp: %d URL path parameters", request->numPathParameters);
-
     // call callback and return response
-    shttp_write_response(route->callback(request), conn);
+    shttpResponse *response;
+    if (route->serialized) {
+        xSemaphoreTake(shttpSerializedRouteLock, portMAX_DELAY);
+        response = route->callback(request);
+        xSemaphoreGive(shttpSerializedRouteLock);
+    } else {
+        response = route->callback(request);
+    }
+    return shttp_write_response(response, connection, keepAlive, headOnly);
 }
 
 //
 // API
 //
 
+ICACHE_FLASH_ATTR char *shttp_path_param(shttpRequest *request, char *name) {
+    for (uint8_t i = 0; i < request->numPathParameters; i++) {
+        if ((request->pathParameterNames[i] != NULL) && (strcmp(request->pathParameterNames[i], name) == 0)) {
+            return request->pathParameters[i];
+        }
+    }
+    return NULL;
+}
+
+ICACHE_FLASH_ATTR int32_t shttp_path_param_int(shttpRequest *request, char *name) {
+    for (uint8_t i = 0; i < request->numPathParameters; i++) {
+        if ((request->pathParameterNames[i] != NULL) && (strcmp(request->pathParameterNames[i], name) == 0)) {
+            return request->pathParameterNumbers[i];
+        }
+    }
+    return 0;
+}
+
 ICACHE_FLASH_ATTR shttpRoute *shttp_route(shttpMethod method, char *path, shttpRouteCallback *callback) {
     shttpRoute *route = malloc(sizeof(shttpRoute));
     route->allowedMethods = method;
     route->path = path;
     route->callback = callback;
+    route->serialized = false;
+    route->priority = false;
+    route->headers = NULL;
+    route->bodyCallback = NULL;
+    route->partCallback = NULL;
+    route->formParameters = false;
+    route->maxBodySize = 0;
+    route->allocated = true;
+
+    return route;
+}
+
+ICACHE_FLASH_ATTR shttpRoute *shttp_route_serialized(shttpRoute *route) {
+    route->serialized = true;
+
+    return route;
+}
+
+ICACHE_FLASH_ATTR shttpRoute *shttp_route_priority(shttpRoute *route) {
+    route->priority = true;
+
+    return route;
+}
+
+ICACHE_FLASH_ATTR shttpRoute *shttp_route_headers(shttpRoute *route, char **headers) {
+    if (!route->allocated) {
+        route->headers = headers;
+        return route;
+    }
+
+    // CAPTURE() builds the list on the stack of the caller, so routes of
+    // shttp_route() keep a copy that is freed with them
+    uint8_t num = 0;
+    while (headers[num] != NULL) {
+        num++;
+    }
+    char **copy = malloc((num + 1) * sizeof(char *));
+    if (copy == NULL) {
+        LOG(ERROR, "shttp: Out of memory while capturing headers of '%s'", route->path);
+        return route;
+    }
+    memcpy(copy, headers, (num + 1) * sizeof(char *));
+
+    free(route->headers);
+    route->headers = copy;
+
+    return route;
+}
+
+ICACHE_FLASH_ATTR shttpRoute *shttp_route_body(shttpRoute *route, shttpRequestBodyCallback *callback) {
+    route->bodyCallback = callback;
+
+    return route;
+}
+
+ICACHE_FLASH_ATTR shttpRoute *shttp_route_multipart(shttpRoute *route, shttpPartCallback *callback) {
+    route->partCallback = callback;
+
+    return route;
+}
+
+ICACHE_FLASH_ATTR shttpRoute *shttp_route_form(shttpRoute *route) {
+    route->formParameters = true;
+
+    return route;
+}
+
+ICACHE_FLASH_ATTR shttpRoute *shttp_route_limit(shttpRoute *route, uint32_t maxBodySize) {
+    route->maxBodySize = maxBodySize;
 
     return route;
 }
\ No newline at end of file
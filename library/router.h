@@ -2,7 +2,41 @@
 #define shttp_router_h_included
 
 #include "simplehttp/http.h"
+#include "response.h"
 
-void shttp_exec_route(char *path, shttpMethod method, shttpRequest *request, struct netconn *conn);
+// find the route for a request, `route` is set to NULL if there is none.
+// `allowed` is set to the methods other routes for the path allow. With
+// appendSlashes set a trailing slash is removed from `path`. The path
+// parameters of the request are set to the parameters in `path`, they are
+// zero terminated in place. Returns false if out of memory
+bool shttp_match_route(shttpConfig *config, char *path, shttpMethod method, shttpRoute **route, shttpMethod *allowed, shttpRequest *request);
+
+// response for a request without route: 404, or 405 with an Allow header
+// if the path exists for the `allowed` methods
+shttpResponse *shttp_no_route_response(shttpMethod allowed);
+
+// names of the headers to store for a request to `route`, NULL for all
+char **shttp_route_capture(shttpConfig *config, shttpRoute *route);
+
+// pass a chunk of a streamed body to the body callback of the route,
+// returns false if the callback aborted the request
+bool shttp_stream_route(shttpRoute *route, shttpRequest *request, char *data, uint16_t len);
+
+// pass an event of a multipart body to the part callback of the route,
+// returns false if the callback aborted the request
+bool shttp_part_route(shttpRoute *route, shttpRequest *request, shttpPart *part, shttpPartEvent event, char *data, uint16_t len);
+
+// run the route found for the request, or answer 404 if `route` is NULL,
+// and write the response. Returns true if the connection may be re-used
+// for another request
+bool shttp_exec_route(shttpRoute *route, char *path, shttpRequest *request, shttpConnection *connection, bool keepAlive, bool headOnly);
+
+// max path length of a request line that is checked for a priority route
+#ifndef SHTTP_PRIORITY_PATH_LEN
+#define SHTTP_PRIORITY_PATH_LEN 64
+#endif
+
+// true if the request line at the start of `data` is for a priority route
+bool shttp_priority_request(shttpConfig *config, char *data, uint16_t len);
 
 #endif /* shttp_router_h_included */
\ No newline at end of file
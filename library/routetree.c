@@ -0,0 +1,430 @@
+#include "routetree.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <c_types.h>
+
+#include "debug.h"
+
+// add a node without children, returns its index or 0 if out of memory,
+// the root is always there
+static ICACHE_FLASH_ATTR uint16_t shttp_route_tree_add(shttpRouteTree *tree, const char *label, uint16_t labelLen) {
+    if (tree->numNodes == UINT16_MAX) {
+        return 0;
+    }
+    if (tree->numNodes == tree->allocatedNodes) {
+        uint32_t allocate = 2 * tree->allocatedNodes;
+        if (allocate > UINT16_MAX) {
+            allocate = UINT16_MAX;
+        }
+        shttpRouteNode *nodes = realloc(tree->nodes, allocate * sizeof(shttpRouteNode));
+        if (nodes == NULL) {
+            return 0;
+        }
+        tree->nodes = nodes;
+        tree->allocatedNodes = allocate;
+    }
+
+    tree->nodes[tree->numNodes] = (shttpRouteNode){ label, labelLen, 0, 0, 0, 0, 0, 0, shttpRouteParamAny };
+    return tree->numNodes++;
+}
+
+// parse the path parameter at the start of `path`, a `?` or `{name}` with
+// an optional `:uint` or `:int` type. Returns its length in the route
+// path, 0 if it is invalid
+static ICACHE_FLASH_ATTR uint16_t shttp_route_param_parse(const char *path, const char **name, uint16_t *nameLen, shttpRouteParamType *type) {
+    if (*path == '?') {
+        *name = NULL;
+        *nameLen = 0;
+        *type = shttpRouteParamAny;
+        return 1;
+    }
+
+    const char *end = strchr(path, '}');
+    if (end == NULL) {
+        return 0;
+    }
+    *name = path + 1;
+    const char *colon = memchr(*name, ':', end - *name);
+    *nameLen = ((colon != NULL) ? colon : end) - *name;
+    if ((*nameLen == 0) || (memchr(*name, '/', end - *name) != NULL)) {
+        return 0;
+    }
+
+    *type = shttpRouteParamAny;
+    if (colon != NULL) {
+        uint16_t typeLen = end - colon - 1;
+        if ((typeLen == 4) && (strncmp(colon + 1, FSTR("uint"), 4) == 0)) {
+            *type = shttpRouteParamUint;
+        } else if ((typeLen == 3) && (strncmp(colon + 1, FSTR("int"), 3) == 0)) {
+            *type = shttpRouteParamInt;
+        } else {
+            return 0;
+        }
+    }
+    return end - path + 1;
+}
+
+// true if the `len` bytes of `value` are accepted by a parameter of `type`
+static ICACHE_FLASH_ATTR bool shttp_route_param_fits(shttpRouteParamType type, const char *value, uint16_t len) {
+    if (type == shttpRouteParamAny) {
+        return true;
+    }
+
+    uint16_t i = 0;
+    uint32_t limit = INT32_MAX;
+    if ((type == shttpRouteParamInt) && (value[0] == '-')) {
+        limit = (uint32_t)INT32_MAX + 1;
+        i++;
+    }
+    if (i == len) {
+        return false;
+    }
+
+    uint32_t number = 0;
+    for (; i < len; i++) {
+        if ((value[i] < '0') || (value[i] > '9')) {
+            return false;
+        }
+        uint8_t digit = value[i] - '0';
+        if (number > (limit - digit) / 10) {
+            return false;
+        }
+        number = number * 10 + digit;
+    }
+    return true;
+}
+
+// add the path of route number `index` to the tree, nodes are only split
+// or added, so the indices of existing nodes stay valid. The names of
+// its parameters are copied to `names`, which is advanced
+static ICACHE_FLASH_ATTR bool shttp_route_tree_insert(shttpRouteTree *tree, shttpRoute *route, uint16_t index, char **names) {
+    const char *path = route->path;
+    uint16_t node = 0;
+    uint16_t param = tree->firstParam[index];
+
+    while (*path != '\0') {
+        // a wildcard has a child of its own
+        if (*path == '*') {
+            if (tree->nodes[node].wildcard == 0) {
+                uint16_t next = shttp_route_tree_add(tree, NULL, 0);
+                if (next == 0) {
+                    return false;
+                }
+                tree->nodes[node].wildcard = next;
+            }
+            node = tree->nodes[node].wildcard;
+            path++;
+            continue;
+        }
+
+        // so has every type of parameter, routes share it whatever the
+        // parameter names are
+        if ((*path == '?') || (*path == '{')) {
+            const char *name;
+            uint16_t nameLen;
+            shttpRouteParamType type;
+            path += shttp_route_param_parse(path, &name, &nameLen, &type);
+
+            tree->paramTypes[param] = type;
+            tree->paramNames[param] = NULL;
+            if (name != NULL) {
+                tree->paramNames[param] = *names;
+                memcpy(*names, name, nameLen);
+                (*names)[nameLen] = '\0';
+                *names += nameLen + 1;
+            }
+            param++;
+
+            uint16_t next = tree->nodes[node].param;
+            while ((next != 0) && (tree->nodes[next].type != type)) {
+                next = tree->nodes[next].sibling;
+            }
+            if (next == 0) {
+                next = shttp_route_tree_add(tree, NULL, 0);
+                if (next == 0) {
+                    return false;
+                }
+                tree->nodes[next].type = type;
+                tree->nodes[next].sibling = tree->nodes[node].param;
+                tree->nodes[node].param = next;
+            }
+            node = next;
+            continue;
+        }
+
+        // static characters up to the next parameter or wildcard
+        uint16_t run = strcspn(path, "?*{");
+        uint16_t child = tree->nodes[node].child;
+        while ((child != 0) && (tree->nodes[child].label[0] != path[0])) {
+            child = tree->nodes[child].sibling;
+        }
+
+        if (child == 0) {
+            child = shttp_route_tree_add(tree, path, run);
+            if (child == 0) {
+                return false;
+            }
+            tree->nodes[child].sibling = tree->nodes[node].child;
+            tree->nodes[node].child = child;
+            node = child;
+            path += run;
+            continue;
+        }
+
+        // follow the common prefix, a label that goes on is split and its
+        // node keeps the first part
+        uint16_t common = 0;
+        while ((common < run) && (common < tree->nodes[child].labelLen) && (tree->nodes[child].label[common] == path[common])) {
+            common++;
+        }
+        if (common < tree->nodes[child].labelLen) {
+            uint16_t tail = shttp_route_tree_add(tree, tree->nodes[child].label + common, tree->nodes[child].labelLen - common);
+            if (tail == 0) {
+                return false;
+            }
+            shttpRouteNode *split = &tree->nodes[child];
+            tree->nodes[tail] = *split;
+            tree->nodes[tail].label += common;
+            tree->nodes[tail].labelLen -= common;
+            tree->nodes[tail].sibling = 0;
+            *split = (shttpRouteNode){ split->label, common, tail, split->sibling, 0, 0, 0, 0, shttpRouteParamAny };
+        }
+        node = child;
+        path += common;
+    }
+
+    // routes with the same path stay in the order of the route list
+    if (tree->nodes[node].route == 0) {
+        tree->nodes[node].route = index + 1;
+    } else {
+        uint16_t last = tree->nodes[node].route - 1;
+        while (tree->nextRoute[last] != 0) {
+            last = tree->nextRoute[last] - 1;
+        }
+        tree->nextRoute[last] = index + 1;
+    }
+    tree->nodes[node].methods |= route->allowedMethods;
+
+    return true;
+}
+
+// state of a lookup, the routes of every matching branch are compared
+typedef struct _shttpRouteMatch {
+    shttpConfig *config;
+    shttpMethod method;
+    shttpMethod allowed;
+
+    // route index of the best match so far, UINT16_MAX for none
+    uint16_t best;
+
+    // starts of the parameters of the branch being followed and of the
+    // best match, NULL if parameters are not needed
+    char **params;
+    char **bestParams;
+    uint16_t numBestParams;
+} shttpRouteMatch;
+
+// take the first route ending at `node` that allows the method, if it
+// comes before the best match so far in the route list
+static ICACHE_FLASH_ATTR void shttp_route_tree_take(shttpRouteMatch *match, const shttpRouteNode *node, uint16_t numParams) {
+    match->allowed |= node->methods;
+    if ((node->methods & match->method) == 0) {
+        return;
+    }
+
+    shttpRouteTree *tree = match->config->routeTree;
+    for (uint16_t route = node->route; (route != 0) && (route - 1 < match->best); route = tree->nextRoute[route - 1]) {
+        if ((match->config->routes[route - 1]->allowedMethods & match->method) != 0) {
+            match->best = route - 1;
+            match->numBestParams = numParams;
+            if (match->params != NULL) {
+                memcpy(match->bestParams, match->params, numParams * sizeof(char *));
+            }
+            return;
+        }
+    }
+}
+
+// find the routes for the rest of the path below `node`. Static children,
+// the parameter and the wildcard may all match, so every branch is
+// followed, each consumes at least one character of the path
+static ICACHE_FLASH_ATTR void shttp_route_tree_match(shttpRouteMatch *match, uint16_t index, char *path, uint16_t numParams) {
+    shttpRouteTree *tree = match->config->routeTree;
+    const shttpRouteNode *node = &tree->nodes[index];
+
+    if (*path == '\0') {
+        shttp_route_tree_take(match, node, numParams);
+        return;
+    }
+
+    for (uint16_t child = node->child; child != 0; child = tree->nodes[child].sibling) {
+        const shttpRouteNode *next = &tree->nodes[child];
+        if (next->label[0] == path[0]) {
+            if (strncmp(next->label, path, next->labelLen) == 0) {
+                shttp_route_tree_match(match, child, path + next->labelLen, numParams);
+            }
+            break;
+        }
+    }
+
+    // a parameter takes the path up to the next slash if it fits its type
+    uint16_t len = (node->param != 0) ? strcspn(path, "/") : 0;
+    for (uint16_t param = node->param; (param != 0) && (len > 0); param = tree->nodes[param].sibling) {
+        if (shttp_route_param_fits(tree->nodes[param].type, path, len)) {
+            if (match->params != NULL) {
+                match->params[numParams] = path;
+            }
+            shttp_route_tree_match(match, param, path + len, numParams + 1);
+        }
+    }
+
+    // a wildcard takes the rest
+    if (node->wildcard != 0) {
+        shttp_route_tree_take(match, &tree->nodes[node->wildcard], numParams);
+    }
+}
+
+//
+// API
+//
+
+ICACHE_FLASH_ATTR bool shttp_route_tree_build(shttpConfig *config) {
+    if ((config->routeTree != NULL) && (!config->routeTree->allocated)) {
+        LOG(DEBUG, "shttp: using generated route table");
+        return true;
+    }
+    shttp_route_tree_destroy(config);
+
+    uint16_t numRoutes = 0;
+    while ((config->routes != NULL) && (config->routes[numRoutes] != NULL)) {
+        numRoutes++;
+    }
+
+    shttpRouteTree *tree = calloc(1, sizeof(shttpRouteTree));
+    if (tree == NULL) {
+        return false;
+    }
+    tree->allocated = true;
+    config->routeTree = tree;
+
+    // count the path parameters and the size of their names first, they
+    // are stored in one block
+    uint16_t numParams = 0;
+    size_t namesSize = 0;
+    tree->firstParam = malloc((numRoutes + 1) * sizeof(uint16_t));
+    if (tree->firstParam == NULL) {
+        shttp_route_tree_destroy(config);
+        return false;
+    }
+    for (uint16_t i = 0; i < numRoutes; i++) {
+        tree->firstParam[i] = numParams;
+        for (char *c = config->routes[i]->path; *c != '\0'; c++) {
+            if ((*c != '?') && (*c != '{')) {
+                continue;
+            }
+
+            const char *name;
+            uint16_t nameLen;
+            shttpRouteParamType type;
+            uint16_t len = shttp_route_param_parse(c, &name, &nameLen, &type);
+            if ((len == 0) || (numParams == UINT16_MAX)) {
+                LOG(ERROR, "shttp: invalid parameter in route '%s'", config->routes[i]->path);
+                shttp_route_tree_destroy(config);
+                return false;
+            }
+            numParams++;
+            namesSize += (name != NULL) ? nameLen + 1 : 0;
+            c += len - 1;
+        }
+        if (numParams - tree->firstParam[i] > UINT8_MAX) {
+            LOG(ERROR, "shttp: route '%s' has more than %d parameters", config->routes[i]->path, UINT8_MAX);
+            shttp_route_tree_destroy(config);
+            return false;
+        }
+        if (numParams - tree->firstParam[i] > tree->maxParams) {
+            tree->maxParams = numParams - tree->firstParam[i];
+        }
+    }
+    tree->firstParam[numRoutes] = numParams;
+
+    tree->nodes = malloc(16 * sizeof(shttpRouteNode));
+    tree->numNodes = 1;
+    tree->allocatedNodes = 16;
+    tree->nextRoute = calloc(numRoutes + 1, sizeof(uint16_t));
+    // the names follow the name pointers
+    tree->paramNames = malloc(numParams * sizeof(char *) + namesSize + 1);
+    tree->paramTypes = malloc((numParams + 1) * sizeof(shttpRouteParamType));
+    if ((tree->nodes == NULL) || (tree->nextRoute == NULL) || (tree->paramNames == NULL) || (tree->paramTypes == NULL)) {
+        shttp_route_tree_destroy(config);
+        return false;
+    }
+
+    // the root stands for the empty path
+    tree->nodes[0] = (shttpRouteNode){ NULL, 0, 0, 0, 0, 0, 0, 0, shttpRouteParamAny };
+
+    char *names = (char *)(tree->paramNames + numParams);
+    for (uint16_t i = 0; i < numRoutes; i++) {
+        if (!shttp_route_tree_insert(tree, config->routes[i], i, &names)) {
+            LOG(ERROR, "shttp: Out of memory while compiling routes");
+            shttp_route_tree_destroy(config);
+            return false;
+        }
+    }
+
+    // give back what the doubling left over
+    shttpRouteNode *nodes = realloc(tree->nodes, tree->numNodes * sizeof(shttpRouteNode));
+    if (nodes != NULL) {
+        tree->nodes = nodes;
+        tree->allocatedNodes = tree->numNodes;
+    }
+
+    LOG(DEBUG, "shttp: compiled %d routes into %d nodes", numRoutes, tree->numNodes);
+    return true;
+}
+
+ICACHE_FLASH_ATTR shttpRoute *shttp_route_tree_find(shttpConfig *config, char *path, shttpMethod method, shttpMethod *allowed, shttpRouteParams *params) {
+    shttpRouteTree *tree = config->routeTree;
+    if (tree == NULL) {
+        LOG(ERROR, "shttp: routes have not been compiled");
+        return NULL;
+    }
+
+    shttpRouteMatch match = { config, method, 0, UINT16_MAX, NULL, NULL, 0 };
+    if (params != NULL) {
+        match.bestParams = params->values;
+        match.params = params->values + tree->maxParams;
+    }
+    shttp_route_tree_match(&match, 0, path, 0);
+    if (allowed != NULL) {
+        *allowed |= match.allowed;
+    }
+    if (match.best == UINT16_MAX) {
+        return NULL;
+    }
+
+    // parameters end at the next slash, they are cut off there only now
+    // as every branch needed the whole path
+    if (params != NULL) {
+        for (uint16_t i = 0; i < match.numBestParams; i++) {
+            params->values[i][strcspn(params->values[i], "/")] = '\0';
+        }
+        params->num = match.numBestParams;
+        params->names = tree->paramNames + tree->firstParam[match.best];
+        params->types = tree->paramTypes + tree->firstParam[match.best];
+    }
+    return config->routes[match.best];
+}
+
+ICACHE_FLASH_ATTR void shttp_route_tree_destroy(shttpConfig *config) {
+    if ((config->routeTree == NULL) || (!config->routeTree->allocated)) {
+        return;
+    }
+    free(config->routeTree->nodes);
+    free(config->routeTree->nextRoute);
+    free(config->routeTree->paramNames);
+    free(config->routeTree->paramTypes);
+    free(config->routeTree->firstParam);
+    free(config->routeTree);
+    config->routeTree = NULL;
+}
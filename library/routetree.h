@@ -0,0 +1,37 @@
+#ifndef shttp_routetree_h_included
+#define shttp_routetree_h_included
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "simplehttp/http.h"
+#include "simplehttp/routetable.h"
+
+// path parameters of the route found
+typedef struct _shttpRouteParams {
+    // room for 2 * maxParams values, the first `num` are set to the
+    // parameters of the route. They are zero terminated in place in the
+    // path
+    char **values;
+    uint8_t num;
+
+    // names and types of the parameters
+    char **names;
+    shttpRouteParamType *types;
+} shttpRouteParams;
+
+// compile the route list of `config` into its route tree, a tree compiled
+// before is replaced, a generated one is kept. Returns false if out of
+// memory or a route path is invalid
+bool shttp_route_tree_build(shttpConfig *config);
+
+// first route in the route list of `config` for `path` and `method`, NULL
+// if there is none. A parameter that does not fit its type does not
+// match. The methods of routes for the path are added to `allowed` if it
+// is not NULL. The parameters are set if `params` is not NULL
+shttpRoute *shttp_route_tree_find(shttpConfig *config, char *path, shttpMethod method, shttpMethod *allowed, shttpRouteParams *params);
+
+// free a compiled route tree, generated ones stay
+void shttp_route_tree_destroy(shttpConfig *config);
+
+#endif /* shttp_routetree_h_included */
@@ -0,0 +1,78 @@
+#ifndef shttp_scan_h_included
+#define shttp_scan_h_included
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+// Word at a time scanning: a word of data is checked for a set of bytes
+// with a few arithmetic operations instead of one compare per byte. The
+// word is as wide as a pointer, 32 bits on the ESP8266.
+
+#if UINTPTR_MAX > 0xffffffffUL
+typedef uint64_t shttpScanWord;
+#else
+typedef uint32_t shttpScanWord;
+#endif
+
+// every byte of the word set to `c`
+#define SHTTP_SCAN_REPEAT(_c) ((shttpScanWord)-1 / 0xff * (uint8_t)(_c))
+
+// non zero if any byte of `w` is zero
+#define SHTTP_SCAN_HAS_ZERO(_w) (((_w) - SHTTP_SCAN_REPEAT(0x01)) & ~(_w) & SHTTP_SCAN_REPEAT(0x80))
+
+// non zero if any byte of `w` equals the repeated byte `r`
+#define SHTTP_SCAN_HAS_BYTE(_w, _r) SHTTP_SCAN_HAS_ZERO((_w) ^ (_r))
+
+// four bytes packed into a word in memory order, for comparing short
+// strings like request methods at once
+#define SHTTP_PACK4(_a, _b, _c, _d) \
+    ((uint32_t)(uint8_t)(_a) | ((uint32_t)(uint8_t)(_b) << 8) | ((uint32_t)(uint8_t)(_c) << 16) | ((uint32_t)(uint8_t)(_d) << 24))
+
+static inline uint32_t shttp_load4(const char *data) {
+    return SHTTP_PACK4(data[0], data[1], data[2], data[3]);
+}
+
+static inline bool shttp_scan_in(char c, const char *set, uint8_t num) {
+    for (uint8_t j = 0; j < num; j++) {
+        if (c == set[j]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// length of the run at the start of `data` that contains none of the
+// `num` bytes in `set`
+static inline uint16_t shttp_scan_any(const char *data, uint16_t len, const char *set, uint8_t num) {
+    uint16_t i = 0;
+
+    // bytes up to the first aligned word
+    while ((i < len) && (((uintptr_t)(data + i) & (sizeof(shttpScanWord) - 1)) != 0)) {
+        if (shttp_scan_in(data[i], set, num)) {
+            return i;
+        }
+        i++;
+    }
+
+    // whole words, the word containing a match is checked byte by byte
+    while (i + sizeof(shttpScanWord) <= len) {
+        shttpScanWord w, found = 0;
+        memcpy(&w, data + i, sizeof(w));
+        for (uint8_t j = 0; j < num; j++) {
+            found |= SHTTP_SCAN_HAS_BYTE(w, SHTTP_SCAN_REPEAT(set[j]));
+        }
+        if (found) {
+            break;
+        }
+        i += sizeof(shttpScanWord);
+    }
+
+    // the rest
+    while ((i < len) && (!shttp_scan_in(data[i], set, num))) {
+        i++;
+    }
+    return i;
+}
+
+#endif /* shttp_scan_h_included */
@@ -12,122 +12,950 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
 #include <freertos/task.h>
+#include <freertos/semphr.h>
+
+#include <esp_common.h>
 
 #include "debug.h"
 #include "simplehttp/http.h"
 
 #include "parser.h"
 #include "router.h"
+#include "routetree.h"
+#include "response.h"
+#include "server.h"
+
+// interval in milliseconds in which blocking network calls wake up to
+// check if the server should stop
+#define SHTTP_STOP_POLL_INTERVAL 250
+
+// time in milliseconds busy data processing tasks get to drop their
+// connection after the drain timeout
+#define SHTTP_ABORT_GRACE (2 * SHTTP_STOP_POLL_INTERVAL)
+
+// the accepting task can only wait for the request line of a connection
+// without blocking if receives time out
+#define SHTTP_PEEK_REQUESTS ((SHTTP_MAX_PENDING_CONNECTIONS > 0) && (LWIP_SO_RCVTIMEO) && (!SHTTP_EVENT_ENGINE))
+
+#ifndef MIN
+#define MIN(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+#endif
+
+#if !SHTTP_EVENT_ENGINE
+typedef struct _shttpWorker {
+    xTaskHandle task;
+
+    // server the task takes its connections from
+    shttpServer *server;
+
+    // set by the task itself when it leaves its loop
+    volatile bool finished;
+} shttpWorker;
+
+// a connection handed to a data processing task
+typedef struct _shttpQueuedConnection {
+    struct netconn *conn;
+
+    // data already received by the accepting task, NULL if none
+    struct netbuf *inbuf;
+} shttpQueuedConnection;
+#endif
+
+#if SHTTP_PEEK_REQUESTS
+// a fresh connection the accepting task waits for the request line of
+typedef struct _shttpPendingConnection {
+    struct netconn *conn;
+    shttpServer *server;
+    portTickType since;
+} shttpPendingConnection;
+#endif
+
+// never freed, the netconn callback may look at it at any time
+static shttpServer servers[SHTTP_MAX_LISTENERS];
+static uint8_t numServers;
+#if !SHTTP_EVENT_ENGINE
+// listening connections with a connection waiting to be accepted and
+// pending connections that received data
+static xQueueHandle acceptQueue;
+#endif
+#if SHTTP_PEEK_REQUESTS
+// never freed, the netconn callback may look at it at any time
+static shttpPendingConnection pending[SHTTP_MAX_PENDING_CONNECTIONS];
+#endif
+static shttpStats stats;
 
-static struct netconn *listeningConn;
-static xQueueHandle connectionQueue;
-static xTaskHandle dataTask;
+// shutdown handling
+static volatile bool running;
+static volatile bool stopRequested;
+static uint32_t stopDrainTimeout;
+static bool stopDrained;
+#if !SHTTP_EVENT_ENGINE
+// set if a data processing task had to be deleted, it may have held the
+// route lock
+static bool workersDeleted;
+#endif
+static xSemaphoreHandle stopSignal;
 
-volatile shttpConfig *shttpServerConfig;
+volatile bool shttpServerDraining;
+xSemaphoreHandle shttpSerializedRouteLock;
 
-ICACHE_FLASH_ATTR static bool bind_and_listen(uint16_t port) {
-    listeningConn = netconn_new(NETCONN_TCP);
-    if (listeningConn == NULL) {
+ICACHE_FLASH_ATTR static bool bind_and_listen(shttpServer *server, netconn_callback callback) {
+    struct netconn *conn = netconn_new_with_callback(NETCONN_TCP, callback);
+    if (conn == NULL) {
         LOG(ERROR, "shttp: creating new netconn failed");
         return false;
     }
 
-    netconn_bind(listeningConn, NULL, port);
-    netconn_listen(listeningConn);
+    if (netconn_bind(conn, NULL, server->config->port) != ERR_OK) {
+        LOG(ERROR, "shttp: could not bind to port %d", server->config->port);
+        netconn_delete(conn);
+        return false;
+    }
+
+    // events of the connection may arrive as soon as it listens
+    server->listeningConn = conn;
+    netconn_listen(conn);
 
     // we are listening
     return true;
 }
 
+ICACHE_FLASH_ATTR static void close_listener(shttpServer *server) {
+    struct netconn *conn = server->listeningConn;
+    if (conn == NULL) {
+        return;
+    }
+
+    server->listeningConn = NULL;
+    netconn_close(conn);
+    netconn_delete(conn);
+}
+
+ICACHE_FLASH_ATTR shttpServer *shttp_find_server(struct netconn *listeningConn) {
+    for(uint8_t i = 0; i < numServers; i++) {
+        if ((servers[i].listeningConn != NULL) && (servers[i].listeningConn == listeningConn)) {
+            return &servers[i];
+        }
+    }
+    return NULL;
+}
+
+ICACHE_FLASH_ATTR bool shttp_low_on_heap(shttpConfig *config) {
+#if SHTTP_LOAD_SHEDDING
+    uint32_t shedFreeHeap = (config->shedFreeHeap > 0) ? config->shedFreeHeap : SHTTP_SHED_FREE_HEAP;
+    return (system_get_free_heap_size() < shedFreeHeap);
+#else
+    return false;
+#endif
+}
+
+// answer the connection with 503 and close it, no parser or route is
+// involved, so this is cheap enough to run in the accepting task
+ICACHE_FLASH_ATTR void shttp_shed_connection(shttpConfig *config, struct netconn *conn, bool lowHeap) {
+    if (lowHeap) {
+        LOG(DEBUG, "shttp: Low on heap, shedding connection");
+        stats.shedLowHeap++;
+    } else {
+        LOG(DEBUG, "shttp: Server busy, shedding connection");
+        stats.shedQueueFull++;
+    }
+
+    uint16_t retryAfter = (config->retryAfter > 0) ? config->retryAfter : SHTTP_RETRY_AFTER;
+    shttp_write_service_unavailable(conn, retryAfter);
+    netconn_close(conn);
+    netconn_delete(conn);
+}
+
+ICACHE_FLASH_ATTR void shttp_count_accepted(void) {
+    stats.acceptedConnections++;
+}
+
+ICACHE_FLASH_ATTR bool shttp_stop_requested(void) {
+    return stopRequested;
+}
+
+ICACHE_FLASH_ATTR uint32_t shttp_stop_drain_timeout(void) {
+    return stopDrainTimeout;
+}
+
+// free all routes created by shttp_route() and the compiled routes
+ICACHE_FLASH_ATTR static void free_routes(shttpConfig *config) {
+    shttp_route_tree_destroy(config);
+    if (config->routes == NULL) {
+        return;
+    }
+    bool freed = false;
+    for(uint16_t i = 0; config->routes[i] != NULL; i++) {
+        if (config->routes[i]->allocated) {
+            free(config->routes[i]->headers);
+            free(config->routes[i]);
+            freed = true;
+        }
+    }
+
+    // the list points to freed routes now, a restart needs a fresh one.
+    // Lists without allocated routes, like generated ones, are kept
+    if (freed) {
+        config->routes = NULL;
+    }
+}
+
+// free the routes of all servers in the table, also when the server
+// could not be started
+ICACHE_FLASH_ATTR static void free_all_routes(void) {
+    for(uint8_t i = 0; i < numServers; i++) {
+        free_routes(servers[i].config);
+    }
+}
+
+// called by the listening task on its way out, however the loop ended.
+// shttp_stop() checks `running` and asks to stop in one critical section,
+// so it either sees the server stopped or is woken up here
+ICACHE_FLASH_ATTR static void finish_listening(void) {
+    taskENTER_CRITICAL();
+    running = false;
+    bool signal = stopRequested;
+    taskEXIT_CRITICAL();
+
+    if (signal) {
+        xSemaphoreGive(stopSignal);
+    }
+}
+
+// fill the server table from the NULL terminated config list
+ICACHE_FLASH_ATTR static bool init_servers(shttpConfig **configs) {
+    memset(servers, 0, sizeof(servers));
+    for(numServers = 0; configs[numServers] != NULL; numServers++) {
+        if (numServers == SHTTP_MAX_LISTENERS) {
+            LOG(ERROR, "shttp: More than %d ports, raise SHTTP_MAX_LISTENERS", SHTTP_MAX_LISTENERS);
+            return false;
+        }
+        servers[numServers].config = configs[numServers];
+
+        // routes are looked up in a tree from now on
+        if (!shttp_route_tree_build(configs[numServers])) {
+            LOG(ERROR, "shttp: Could not compile routes for port %d", configs[numServers]->port);
+
+            // its routes are freed with the others
+            numServers++;
+            return false;
+        }
+    }
+
+    return (numServers > 0);
+}
+
+#if !SHTTP_EVENT_ENGINE
+ICACHE_FLASH_ATTR static void in_flight_add(shttpServer *server, int8_t delta) {
+    taskENTER_CRITICAL();
+    server->inFlight += delta;
+    taskEXIT_CRITICAL();
+}
+
+// netconn callback of the listening connections, runs in the lwIP task
+ICACHE_FLASH_ATTR static void accept_event(struct netconn *conn, enum netconn_evt evt, u16_t len) {
+    if (evt != NETCONN_EVT_RCVPLUS) {
+        return;
+    }
+
+    // accepted connections inherit the callback, only listening and
+    // pending connections are of interest. Never block the lwIP task,
+    // the poll picks up lost events
+    for(uint8_t i = 0; i < SHTTP_MAX_LISTENERS; i++) {
+        if ((servers[i].listeningConn != NULL) && (servers[i].listeningConn == conn)) {
+            xQueueSendToBack(acceptQueue, &conn, 0);
+            return;
+        }
+    }
+#if SHTTP_PEEK_REQUESTS
+    for(uint8_t i = 0; i < SHTTP_MAX_PENDING_CONNECTIONS; i++) {
+        if ((pending[i].conn != NULL) && (pending[i].conn == conn)) {
+            xQueueSendToBack(acceptQueue, &conn, 0);
+            return;
+        }
+    }
+#endif
+}
+
 void readTask(void *userData) {
+    shttpWorker *self = (shttpWorker *)userData;
+    shttpServer *server = self->server;
+    shttpQueuedConnection queued;
     struct netconn *conn;
     struct netbuf *inbuf = NULL;
-    char *recv_buffer;
-    uint16_t buflen;
     err_t err;
     shttpParserState *parser;
 
     while(1) {
-        // fetch a connection from the queue
-        xQueueReceive(connectionQueue, &conn, portMAX_DELAY);
+        // fetch a connection, the priority lane always goes first
+        xSemaphoreTake(server->queued, portMAX_DELAY);
+        if ((xQueueReceive(server->priorityQueue, &queued, 0) != pdTRUE) &&
+            (xQueueReceive(server->connectionQueue, &queued, 0) != pdTRUE)) {
+            continue;
+        }
+        conn = queued.conn;
+        inbuf = queued.inbuf;
+
+        // a NULL connection means the server is shutting down
+        if (conn == NULL) {
+            break;
+        }
 
         // create a parser
-        parser = shttp_parser_init_state();
+        parser = shttp_parser_init_state(server->config);
+        if (parser == NULL) {
+            LOG(ERROR, "shttp: Out of memory while creating parser");
+            if (inbuf != NULL) {
+                netbuf_delete(inbuf);
+            }
+            netconn_close(conn);
+            netconn_delete(conn);
+            in_flight_add(server, -1);
+            continue;
+        }
+
+        shttpConnection connection = { conn, server->config, false, NULL };
+
+#if LWIP_SO_SNDTIMEO
+        // responses are written blocking, a client that does not take any
+        // data for the write timeout makes the write return
+        netconn_set_sendtimeout(conn, (server->config->writeTimeout > 0) ? server->config->writeTimeout : SHTTP_WRITE_TIMEOUT);
+#endif
+
+        shttpPhaseClock clock;
+        shttp_phase_start(&clock, parser);
 
         // receive data
-        while(1) {
-            err = netconn_recv(conn, &inbuf);
+        bool open = true;
+        while(open) {
+            if (inbuf != NULL) {
+                // the accepting task already received the request line
+                err = ERR_OK;
+            } else {
+#if LWIP_SO_RCVTIMEO
+                if (server->aborting) {
+                    LOG(DEBUG, "shttp: server stopped, dropping connection");
+                    break;
+                }
+
+                uint32_t remaining = shttp_phase_remaining(&clock, server->config);
+                if (remaining == 0) {
+                    err = ERR_TIMEOUT;
+                } else {
+                    // wake up regularly to notice a shutdown, the deadline is
+                    // checked again above
+                    netconn_set_recvtimeout(conn, MIN(remaining, SHTTP_STOP_POLL_INTERVAL));
+                    err = netconn_recv(conn, &inbuf);
+                    if (err == ERR_TIMEOUT) {
+                        continue;
+                    }
+                }
+#else
+                err = netconn_recv(conn, &inbuf);
+#endif
+            }
 
+            if (err == ERR_TIMEOUT) {
+                shttp_phase_expired(&clock, &connection);
+                break;
+            }
             if (err != ERR_OK) {
-                LOG(DEBUG, "shttp: client disconnected");
+                LOG(DEBUG, "shttp: client disconnected (%d)", err);
                 break;
-            } else {
-                netbuf_data(inbuf, (void **)&recv_buffer, &buflen);
+            }
 
-                // received some bytes, run parser on it
-                if (!shttp_parse(parser, recv_buffer, buflen, conn)) {
-                    // parser thinks we should close the connection
-                    LOG(DEBUG, "shttp: parse called for quit");
-                    break;
-                }
+            // received some bytes, the parser takes the buffer
+            if (!shttp_parse(parser, inbuf, &connection)) {
+                // parser thinks we should close the connection
+                LOG(DEBUG, "shttp: parse called for quit");
+                open = false;
             }
+            inbuf = NULL;
+            shttp_phase_update(&clock, parser);
         }
 
         // clean up
         netconn_close(conn);
-        netbuf_delete(inbuf);
         netconn_delete(conn);
         shttp_destroy_parser(parser);
+        in_flight_add(server, -1);
         LOG(DEBUG, "shttp: connection closed");
     }
+
+    LOG(DEBUG, "shttp: data processing task finished");
+    self->finished = true;
+    vTaskDelete(NULL);
 }
 
-ICACHE_FLASH_ATTR void shttp_listen(shttpConfig *config) {
+// returns false if the task did not finish before the deadline
+ICACHE_FLASH_ATTR static bool wait_for_worker(shttpWorker *worker, portTickType deadline) {
+    while ((!worker->finished) && ((int32_t)(deadline - xTaskGetTickCount()) > 0)) {
+        vTaskDelay(1);
+    }
+    return worker->finished;
+}
+
+// ask all data processing tasks of the server to quit and wait for them
+// until the deadline. Tasks still busy then get SHTTP_ABORT_GRACE to drop
+// their connection, a task stuck in a route callback is deleted and the
+// memory of its connection is lost. Returns false if a task was deleted
+ICACHE_FLASH_ATTR static bool stop_data_tasks(shttpServer *server, portTickType deadline) {
+    shttpQueuedConnection queued = { NULL, NULL };
+
+    for(uint8_t i = 0; i < server->numWorkers; i++) {
+        if (xQueueSendToBack(server->connectionQueue, &queued, 0) != pdPASS) {
+            break;
+        }
+        xSemaphoreGive(server->queued);
+    }
+
+    bool deleted = false;
+    for(uint8_t i = 0; i < server->numWorkers; i++) {
+        if ((!wait_for_worker(&server->workers[i], deadline)) && (!server->aborting)) {
+            LOG(DEBUG, "shttp: drain timeout over, aborting connections");
+            server->aborting = true;
+            deadline = xTaskGetTickCount() + SHTTP_ABORT_GRACE / portTICK_RATE_MS;
+            wait_for_worker(&server->workers[i], deadline);
+        }
+        if (!server->workers[i].finished) {
+            LOG(ERROR, "shttp: data processing task %d did not finish, deleting, its connection is leaked", i);
+            vTaskDelete(server->workers[i].task);
+            deleted = true;
+        }
+    }
+
+    free(server->workers);
+    server->workers = NULL;
+    server->numWorkers = 0;
+
+    return !deleted;
+}
+
+ICACHE_FLASH_ATTR static bool start_data_tasks(shttpServer *server) {
+    uint8_t count = (server->config->workers > 0) ? server->config->workers : SHTTP_WORKERS;
+    uint16_t stackSize = (server->config->workerStackSize > 0) ? server->config->workerStackSize : SHTTP_STACK_SIZE;
+
+    server->workers = malloc(count * sizeof(shttpWorker));
+    if (server->workers == NULL) {
+        LOG(ERROR, "shttp: Out of memory while creating data processing tasks");
+        return false;
+    }
+
+    // every task of the server pulls connections from the same lanes
+    for(server->numWorkers = 0; server->numWorkers < count; server->numWorkers++) {
+        shttpWorker *worker = &server->workers[server->numWorkers];
+        worker->server = server;
+        worker->finished = false;
+        if (xTaskCreate(readTask, "shttp.read", stackSize, worker, SHTTP_PRIO, &worker->task) != pdPASS) {
+            LOG(ERROR, "shttp: Could not create data processing task %d", server->numWorkers);
+            workersDeleted |= !stop_data_tasks(server, xTaskGetTickCount());
+            return false;
+        }
+    }
+
+    LOG(DEBUG, "shttp: started %d data processing tasks for port %d", server->numWorkers, server->config->port);
+    return true;
+}
+
+// close all connections still waiting in a lane, `queued` has to keep
+// counting what is left in the lanes
+ICACHE_FLASH_ATTR static void close_queued(shttpServer *server, xQueueHandle lane) {
+    shttpQueuedConnection queued;
+
+    while (xQueueReceive(lane, &queued, 0) == pdTRUE) {
+        xSemaphoreTake(server->queued, 0);
+        if (queued.inbuf != NULL) {
+            netbuf_delete(queued.inbuf);
+        }
+        netconn_close(queued.conn);
+        netconn_delete(queued.conn);
+        in_flight_add(server, -1);
+    }
+}
+
+// wait for queued and running requests, returns false if they did not
+// finish before the deadline and had to be aborted
+ICACHE_FLASH_ATTR static bool drain_connections(shttpServer *server, portTickType deadline) {
+    while ((server->inFlight > 0) && ((int32_t)(deadline - xTaskGetTickCount()) > 0)) {
+        vTaskDelay(1);
+    }
+
+    // close everything that is still waiting in the lanes
+    bool drained = (server->inFlight == 0);
+    close_queued(server, server->priorityQueue);
+    close_queued(server, server->connectionQueue);
+
+    return drained;
+}
+
+// a deleted task may still hold the route lock, it is left to the task
+// then and a new one is created by the next shttp_listen()
+ICACHE_FLASH_ATTR static void release_route_lock(void) {
+    if (workersDeleted) {
+        LOG(ERROR, "shttp: data processing tasks were deleted, keeping the route lock");
+        return;
+    }
+    vSemaphoreDelete(shttpSerializedRouteLock);
+}
+
+// create the queue and data processing tasks of a server and start
+// listening on its port
+ICACHE_FLASH_ATTR static bool start_server(shttpServer *server) {
+    uint8_t queueDepth = (server->config->queueDepth > 0) ? server->config->queueDepth : SHTTP_MAX_QUEUED_CONNECTIONS;
+
+    server->inFlight = 0;
+    server->aborting = false;
+
+    // only wait for request lines if there is something to prioritize
+    server->priorityRoutes = false;
+    for(uint16_t i = 0; (server->config->routes != NULL) && (server->config->routes[i] != NULL); i++) {
+        if (server->config->routes[i]->priority) {
+            server->priorityRoutes = true;
+        }
+    }
+
+    // Create data processing lanes, the count has room for the shutdown
+    // sentinels of the tasks
+    server->connectionQueue = xQueueCreate(queueDepth, sizeof(shttpQueuedConnection));
+    server->priorityQueue = xQueueCreate(queueDepth, sizeof(shttpQueuedConnection));
+    server->queued = xSemaphoreCreateCounting(2 * queueDepth, 0);
+    if ((server->connectionQueue == NULL) || (server->priorityQueue == NULL) || (server->queued == NULL)) {
+        LOG(ERROR, "shttp: Could not create connection queue");
+        return false;
+    }
+
+    // start data processing tasks
+    if (!start_data_tasks(server)) {
+        return false;
+    }
+
+    // bind and listen, the accepting task is notified of new connections
+    if (!bind_and_listen(server, accept_event)) {
+        return false;
+    }
+
+#if LWIP_SO_RCVTIMEO
+    // a 1 ms timeout makes netconn_accept return immediately if there is
+    // no connection
+    netconn_set_recvtimeout(server->listeningConn, 1);
+#endif
+
+    return true;
+}
+
+// let the running requests of a server finish until the deadline and
+// release it, returns false if requests had to be aborted
+ICACHE_FLASH_ATTR static bool stop_server(shttpServer *server, portTickType deadline) {
+    bool drained = true;
+
+    close_listener(server);
+    if ((server->connectionQueue != NULL) && (server->priorityQueue != NULL) && (server->queued != NULL)) {
+        if (server->workers != NULL) {
+            drained = drain_connections(server, deadline);
+            if (!stop_data_tasks(server, deadline)) {
+                workersDeleted = true;
+                drained = false;
+            }
+        }
+    }
+
+    if (server->connectionQueue != NULL) {
+        vQueueDelete(server->connectionQueue);
+        server->connectionQueue = NULL;
+    }
+    if (server->priorityQueue != NULL) {
+        vQueueDelete(server->priorityQueue);
+        server->priorityQueue = NULL;
+    }
+    if (server->queued != NULL) {
+        vSemaphoreDelete(server->queued);
+        server->queued = NULL;
+    }
+
+    return drained;
+}
+
+// hand an accepted connection to a data processing task of the server,
+// `inbuf` is data already received from it or NULL
+ICACHE_FLASH_ATTR static void queue_connection(shttpServer *server, struct netconn *conn, struct netbuf *inbuf, bool priority) {
+    shttpQueuedConnection queued = { conn, inbuf };
+    xQueueHandle lane = (priority) ? server->priorityQueue : server->connectionQueue;
+
+    LOG(TRACE, "shttp: Client connected, signaling communications thread");
+#if SHTTP_LOAD_SHEDDING
+    if (xQueueSendToBack(lane, &queued, 0) != pdPASS) {
+        if (inbuf != NULL) {
+            netbuf_delete(inbuf);
+        }
+        in_flight_add(server, -1);
+        shttp_shed_connection(server->config, conn, false);
+        return;
+    }
+#else
+    // this stalls accepting on all ports until a task of this server
+    // is free
+    xQueueSendToBack(lane, &queued, portMAX_DELAY);
+#endif
+    xSemaphoreGive(server->queued);
+    shttp_count_accepted();
+}
+
+#if SHTTP_PEEK_REQUESTS
+// hold a fresh connection back until its request line arrives, returns
+// false if all slots are taken
+ICACHE_FLASH_ATTR static bool add_pending(shttpServer *server, struct netconn *conn) {
+    for(uint8_t i = 0; i < SHTTP_MAX_PENDING_CONNECTIONS; i++) {
+        if (pending[i].conn == NULL) {
+            // a 1 ms timeout makes netconn_recv return immediately if
+            // there is no data
+            netconn_set_recvtimeout(conn, 1);
+            pending[i].server = server;
+            pending[i].since = xTaskGetTickCount();
+
+            // the callback looks at the connection, so set it last
+            pending[i].conn = conn;
+            return true;
+        }
+    }
+    return false;
+}
+
+// queue a pending connection in the lane of its request, if nothing has
+// been received yet it stays pending unless `force` is set
+ICACHE_FLASH_ATTR static void classify_pending(shttpPendingConnection *slot, bool force) {
+    struct netbuf *inbuf = NULL;
+    struct netconn *conn = slot->conn;
+    shttpServer *server = slot->server;
+    bool priority = false;
+
+    err_t err = netconn_recv(conn, &inbuf);
+    if ((err == ERR_TIMEOUT) && (!force)) {
+        return;
+    }
+
+    slot->conn = NULL;
+    if ((err != ERR_OK) && (err != ERR_TIMEOUT)) {
+        LOG(DEBUG, "shttp: client disconnected (%d)", err);
+        netconn_close(conn);
+        netconn_delete(conn);
+        in_flight_add(server, -1);
+        return;
+    }
+
+    if (inbuf != NULL) {
+        char *data;
+        uint16_t len;
+        netbuf_data(inbuf, (void **)&data, &len);
+        priority = shttp_priority_request(server->config, data, len);
+    }
+    queue_connection(server, conn, inbuf, priority);
+}
+
+ICACHE_FLASH_ATTR static shttpPendingConnection *find_pending(struct netconn *conn) {
+    for(uint8_t i = 0; i < SHTTP_MAX_PENDING_CONNECTIONS; i++) {
+        if ((pending[i].conn != NULL) && (pending[i].conn == conn)) {
+            return &pending[i];
+        }
+    }
+    return NULL;
+}
+
+// check all pending connections for lost events, a connection that did
+// not send anything for a poll interval is queued normally and left to
+// the timeouts of the data processing task
+ICACHE_FLASH_ATTR static void poll_pending(void) {
+    for(uint8_t i = 0; i < SHTTP_MAX_PENDING_CONNECTIONS; i++) {
+        if (pending[i].conn == NULL) {
+            continue;
+        }
+        uint32_t elapsed = (xTaskGetTickCount() - pending[i].since) * portTICK_RATE_MS;
+        classify_pending(&pending[i], (elapsed >= SHTTP_STOP_POLL_INTERVAL));
+    }
+}
+
+ICACHE_FLASH_ATTR static void close_pending(void) {
+    for(uint8_t i = 0; i < SHTTP_MAX_PENDING_CONNECTIONS; i++) {
+        struct netconn *conn = pending[i].conn;
+        if (conn == NULL) {
+            continue;
+        }
+        pending[i].conn = NULL;
+        netconn_close(conn);
+        netconn_delete(conn);
+        in_flight_add(pending[i].server, -1);
+    }
+}
+#endif
+
+// accept one connection of the server and hand it to a data processing
+// task, returns ERR_TIMEOUT if there was no connection
+ICACHE_FLASH_ATTR static err_t accept_connection(shttpServer *server) {
     struct netconn *incoming;
-    err_t err;
 
-    // bind and listen
-    bool result = bind_and_listen(config->port);
-    if (result == false){
-        LOG(ERROR, "shttp: Giving up");
+    err_t err = netconn_accept(server->listeningConn, &incoming);
+    if (err != ERR_OK) {
+        return err;
+    }
+
+    in_flight_add(server, 1);
+    if (shttp_low_on_heap(server->config)) {
+        in_flight_add(server, -1);
+        shttp_shed_connection(server->config, incoming, true);
+        return ERR_OK;
+    }
+
+#if SHTTP_PEEK_REQUESTS
+    // the lane is picked from the request line, if it has not arrived yet
+    // the connection waits for it
+    if (server->priorityRoutes) {
+        if (add_pending(server, incoming)) {
+            classify_pending(find_pending(incoming), false);
+            return ERR_OK;
+        }
+    }
+#endif
+
+    queue_connection(server, incoming, NULL, false);
+    return ERR_OK;
+}
+#endif /* !SHTTP_EVENT_ENGINE */
+
+#if SHTTP_EVENT_ENGINE
+ICACHE_FLASH_ATTR void shttp_listen_all(shttpConfig **configs) {
+    shttpServerDraining = false;
+    stopRequested = false;
+    stopDrainTimeout = 0;
+
+    if (!init_servers(configs)) {
+        LOG(ERROR, "shttp: No valid config, terminating");
+        free_all_routes();
         return;
     }
 
-    // Create data processing queue
-    connectionQueue = xQueueCreate(SHTTP_MAX_QUEUED_CONNECTIONS, sizeof(int));
-    if (connectionQueue == NULL) {
-        LOG(ERROR, "shttp: Could not create connection queue, terminating");
-        netconn_close(listeningConn);
-        netconn_delete(listeningConn);
+    for(uint8_t i = 0; i < numServers; i++) {
+        shttpConfig *config = servers[i].config;
+        servers[i].maxClients = (config->maxConnections > 0) ? config->maxConnections : SHTTP_MAX_CONNECTIONS;
+    }
+
+    // Create lock for routes that may not run concurrently, with one
+    // task it is never contended but keeps the router identical
+    shttpSerializedRouteLock = xSemaphoreCreateMutex();
+    if (shttpSerializedRouteLock == NULL) {
+        LOG(ERROR, "shttp: Could not create route lock, terminating");
+        free_all_routes();
         return;
     }
 
-    // start data processing task
-    if (xTaskCreate(readTask, "shttp.read", SHTTP_STACK_SIZE, NULL, SHTTP_PRIO, &dataTask) != pdPASS) {
-        LOG(ERROR, "shttp: Could not create data processing task, terminating");
-        vQueueDelete(connectionQueue);
-        netconn_close(listeningConn);
-        netconn_delete(listeningConn);
+    // the engine has to be ready before the first event arrives
+    if (!shttp_engine_init(servers, numServers)) {
+        LOG(ERROR, "shttp: Could not create event engine, terminating");
+        vSemaphoreDelete(shttpSerializedRouteLock);
+        free_all_routes();
         return;
     }
 
-    shttpServerConfig = config;
+    // bind and listen, events of the listening connections and all
+    // connections accepted from them go to the engine
+    for(uint8_t i = 0; i < numServers; i++) {
+        if (!bind_and_listen(&servers[i], shttp_engine_event)) {
+            LOG(ERROR, "shttp: Giving up");
+            for(uint8_t j = 0; j < i; j++) {
+                close_listener(&servers[j]);
+            }
+            shttp_engine_destroy();
+            vSemaphoreDelete(shttpSerializedRouteLock);
+            free_all_routes();
+            return;
+        }
+    }
+
+    running = true;
     LOG(DEBUG, "shttp: server ready to accept connections");
 
-    // accept connections
-    while(1) {
+    // serve all connections from this task until the server is stopped,
+    // the engine closes the listening connections
+    stopDrained = shttp_engine_run();
+
+    // release everything
+    shttp_engine_destroy();
+    vSemaphoreDelete(shttpSerializedRouteLock);
+    for(uint8_t i = 0; i < numServers; i++) {
+        servers[i].listeningConn = NULL;
+    }
+    free_all_routes();
+    shttpServerDraining = false;
+    LOG(DEBUG, "shttp: server stopped");
+    finish_listening();
+}
+#else
+ICACHE_FLASH_ATTR void shttp_listen_all(shttpConfig **configs) {
+    struct netconn *conn;
+    err_t err = ERR_OK;
+
+    shttpServerDraining = false;
+    stopRequested = false;
+    stopDrainTimeout = 0;
+    workersDeleted = false;
+
+    if (!init_servers(configs)) {
+        LOG(ERROR, "shttp: No valid config, terminating");
+        free_all_routes();
+        return;
+    }
+
+    // Create lock for routes that may not run concurrently
+    shttpSerializedRouteLock = xSemaphoreCreateMutex();
+    if (shttpSerializedRouteLock == NULL) {
+        LOG(ERROR, "shttp: Could not create route lock, terminating");
+        free_all_routes();
+        return;
+    }
+
+    // one event per connection to accept or request line to look at, the
+    // poll catches up on lost ones
+    acceptQueue = xQueueCreate(numServers * 4 + SHTTP_MAX_PENDING_CONNECTIONS, sizeof(struct netconn *));
+    if (acceptQueue == NULL) {
+        LOG(ERROR, "shttp: Could not create accept queue, terminating");
+        vSemaphoreDelete(shttpSerializedRouteLock);
+        free_all_routes();
+        return;
+    }
+
+    for(uint8_t i = 0; i < numServers; i++) {
+        if (!start_server(&servers[i])) {
+            LOG(ERROR, "shttp: Giving up");
+            for(uint8_t j = 0; j <= i; j++) {
+                stop_server(&servers[j], xTaskGetTickCount());
+            }
+            vQueueDelete(acceptQueue);
+            acceptQueue = NULL;
+            release_route_lock();
+            free_all_routes();
+            return;
+        }
+    }
+
+    running = true;
+    LOG(DEBUG, "shttp: server ready to accept connections");
+
+    // accept connections of all ports from this task
+    portTickType lastPoll = xTaskGetTickCount();
+    while((!stopRequested) && ((err == ERR_OK) || (err == ERR_TIMEOUT))) {
+
+        // wake up regularly to notice a shutdown
+        if (xQueueReceive(acceptQueue, &conn, SHTTP_STOP_POLL_INTERVAL / portTICK_RATE_MS) == pdTRUE) {
+            shttpServer *server = shttp_find_server(conn);
+            if (server != NULL) {
+                // every event stands for one connection, so this does not
+                // block even without a receive timeout
+                err = accept_connection(server);
+                if ((err != ERR_OK) && (err != ERR_TIMEOUT)) {
+                    break;
+                }
+            }
+#if SHTTP_PEEK_REQUESTS
+            shttpPendingConnection *slot = find_pending(conn);
+            if (slot != NULL) {
+                classify_pending(slot, false);
+            }
+#endif
+        }
 
-        // this blocks until a client connects
-        err = netconn_accept(listeningConn, &incoming);
-        if (err == ERR_OK) {
-            LOG(TRACE, "shttp: Client connected, signaling communications thread");
-            xQueueSendToBack(connectionQueue, &incoming, portMAX_DELAY);
-        } else {
-            LOG(ERROR, "shttp: Could not accept connection, terminating");
-            vTaskDelete(dataTask);
-            vQueueDelete(connectionQueue);
-            netconn_close(listeningConn);
-            netconn_delete(listeningConn);
+        // even under a constant stream of events everything is checked
+        // regularly
+        if ((xTaskGetTickCount() - lastPoll) * portTICK_RATE_MS < SHTTP_STOP_POLL_INTERVAL) {
+            continue;
+        }
+        lastPoll = xTaskGetTickCount();
+
+#if LWIP_SO_RCVTIMEO
+        // accept connections of events that have been lost
+        for(uint8_t i = 0; i < numServers; i++) {
+            do {
+                err = accept_connection(&servers[i]);
+            } while (err == ERR_OK);
+            if (err != ERR_TIMEOUT) {
+                break;
+            }
         }
+#endif
+#if SHTTP_PEEK_REQUESTS
+        poll_pending();
+#endif
+    }
+
+    if ((err != ERR_OK) && (err != ERR_TIMEOUT)) {
+        LOG(ERROR, "shttp: Could not accept connection, terminating");
+    }
+
+    // stop accepting on all ports, then let the running requests finish,
+    // persistent connections are closed after their current request
+    for(uint8_t i = 0; i < numServers; i++) {
+        close_listener(&servers[i]);
+    }
+#if SHTTP_PEEK_REQUESTS
+    close_pending();
+#endif
+    shttpServerDraining = true;
+
+    portTickType deadline = xTaskGetTickCount() + stopDrainTimeout / portTICK_RATE_MS;
+    stopDrained = true;
+    for(uint8_t i = 0; i < numServers; i++) {
+        if (!stop_server(&servers[i], deadline)) {
+            stopDrained = false;
+        }
+    }
+
+    // release everything
+    vQueueDelete(acceptQueue);
+    acceptQueue = NULL;
+    release_route_lock();
+    free_all_routes();
+    shttpServerDraining = false;
+    LOG(DEBUG, "shttp: server stopped");
+    finish_listening();
+}
+#endif /* SHTTP_EVENT_ENGINE */
+
+ICACHE_FLASH_ATTR void shttp_listen(shttpConfig *config) {
+    shttpConfig *configs[] = { config, NULL };
+    shttp_listen_all(configs);
+}
+
+ICACHE_FLASH_ATTR bool shttp_stop(uint32_t drainTimeout) {
+    if (!running) {
+        return true;
+    }
+
+    stopSignal = xSemaphoreCreateCounting(1, 0);
+    if (stopSignal == NULL) {
+        LOG(ERROR, "shttp: Out of memory while stopping server");
+        return false;
     }
+
+    // the listening task notices this within SHTTP_STOP_POLL_INTERVAL, it
+    // may also just have left its loop on its own
+    taskENTER_CRITICAL();
+    bool wasRunning = running;
+    if (wasRunning) {
+        stopDrainTimeout = drainTimeout;
+        stopRequested = true;
+    }
+    taskEXIT_CRITICAL();
+
+    if (wasRunning) {
+        xSemaphoreTake(stopSignal, portMAX_DELAY);
+    }
+
+    vSemaphoreDelete(stopSignal);
+    stopSignal = NULL;
+
+    return stopDrained;
+}
+
+ICACHE_FLASH_ATTR void shttp_get_stats(shttpStats *result) {
+    memcpy(result, &stats, sizeof(shttpStats));
 }
@@ -0,0 +1,101 @@
+#ifndef shttp_server_h_included
+#define shttp_server_h_included
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+
+#include "simplehttp/http.h"
+#include "parser.h"
+#include "response.h"
+
+// one listening port with its own routes and limits
+typedef struct _shttpServer {
+    shttpConfig *config;
+    struct netconn *listeningConn;
+
+#if SHTTP_EVENT_ENGINE
+    // connections currently served and the limit for them
+    uint8_t numClients;
+    uint8_t maxClients;
+#else
+    // connections waiting for a data processing task, the tasks always
+    // take from the priority lane first, `queued` counts both lanes
+    xQueueHandle connectionQueue;
+    xQueueHandle priorityQueue;
+    xSemaphoreHandle queued;
+
+    // set if the routes contain PRIORITY routes
+    bool priorityRoutes;
+
+    struct _shttpWorker *workers;
+    uint8_t numWorkers;
+
+    // connections queued or being processed
+    volatile uint16_t inFlight;
+
+    // set when the drain timeout is over, the tasks drop their connection
+    // at the next receive timeout
+    volatile bool aborting;
+#endif
+} shttpServer;
+
+// the phase the parser of a connection is in and when it started, every
+// phase has a deadline a client trickling in data can not extend
+typedef struct _shttpPhaseClock {
+    shttpParserPhase phase;
+    portTickType start;
+} shttpPhaseClock;
+
+// timeout in milliseconds for the phase the parser is in
+uint32_t shttp_phase_timeout(shttpConfig *config, shttpParserPhase phase);
+
+// start the clock on the phase the parser is in
+void shttp_phase_start(shttpPhaseClock *clock, shttpParserState *parser);
+
+// call after the parser took data, restarts the clock on a new phase
+void shttp_phase_update(shttpPhaseClock *clock, shttpParserState *parser);
+
+// milliseconds left until the deadline of the phase, 0 once it passed
+uint32_t shttp_phase_remaining(shttpPhaseClock *clock, shttpConfig *config);
+
+// handle a missed deadline, returns true if the client was answered with
+// 408 and the connection has to close after the response
+bool shttp_phase_expired(shttpPhaseClock *clock, shttpConnection *connection);
+
+// server the listening connection belongs to, NULL if none
+shttpServer *shttp_find_server(struct netconn *listeningConn);
+
+// true if new connections should be shed because the heap runs low
+bool shttp_low_on_heap(shttpConfig *config);
+
+// answer the connection with 503, close it and count it in the stats
+void shttp_shed_connection(shttpConfig *config, struct netconn *conn, bool lowHeap);
+
+// count a connection that has been accepted for processing
+void shttp_count_accepted(void);
+
+// set by shttp_stop(), the listening task should stop accepting and
+// drain the running requests within the drain timeout
+bool shttp_stop_requested(void);
+uint32_t shttp_stop_drain_timeout(void);
+
+// set while the server drains, persistent connections are closed after
+// the current request
+extern volatile bool shttpServerDraining;
+
+#if SHTTP_EVENT_ENGINE
+// netconn callback of the listening connections and all their clients
+void shttp_engine_event(struct netconn *conn, enum netconn_evt evt, u16_t len);
+
+// connection slots are shared by all servers, every server may use up
+// to its maxClients of them
+bool shttp_engine_init(shttpServer *servers, uint8_t numServers);
+
+// serve connections until the server is stopped, closes the listening
+// connections and returns false if requests had to be aborted
+bool shttp_engine_run(void);
+void shttp_engine_destroy(void);
+#endif
+
+#endif /* shttp_server_h_included */
@@ -0,0 +1,58 @@
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "debug.h"
+#include "simplehttp/http.h"
+
+#include "parser.h"
+#include "response.h"
+#include "server.h"
+
+ICACHE_FLASH_ATTR uint32_t shttp_phase_timeout(shttpConfig *config, shttpParserPhase phase) {
+    switch (phase) {
+        case shttpParserPhaseHeaders:
+            return (config->headerTimeout > 0) ? config->headerTimeout : SHTTP_HEADER_TIMEOUT;
+        case shttpParserPhaseBody:
+        case shttpParserPhaseStream:
+            return (config->bodyTimeout > 0) ? config->bodyTimeout : SHTTP_BODY_TIMEOUT;
+        default:
+            return (config->keepAliveTimeout > 0) ? config->keepAliveTimeout : SHTTP_KEEPALIVE_TIMEOUT;
+    }
+}
+
+ICACHE_FLASH_ATTR void shttp_phase_start(shttpPhaseClock *clock, shttpParserState *parser) {
+    clock->phase = shttp_parser_phase(parser);
+    clock->start = xTaskGetTickCount();
+}
+
+ICACHE_FLASH_ATTR void shttp_phase_update(shttpPhaseClock *clock, shttpParserState *parser) {
+    // idle means a request has just been finished, a streamed body may
+    // take as long as it keeps sending
+    shttpParserPhase phase = shttp_parser_phase(parser);
+    if ((phase != clock->phase) || (phase == shttpParserPhaseIdle) || (phase == shttpParserPhaseStream)) {
+        clock->phase = phase;
+        clock->start = xTaskGetTickCount();
+    }
+}
+
+ICACHE_FLASH_ATTR uint32_t shttp_phase_remaining(shttpPhaseClock *clock, shttpConfig *config) {
+    // while draining idle persistent connections are closed right away
+    if ((shttpServerDraining) && (clock->phase == shttpParserPhaseIdle)) {
+        return 0;
+    }
+
+    uint32_t timeout = shttp_phase_timeout(config, clock->phase);
+    uint32_t elapsed = (xTaskGetTickCount() - clock->start) * portTICK_RATE_MS;
+    return (elapsed < timeout) ? timeout - elapsed : 0;
+}
+
+ICACHE_FLASH_ATTR bool shttp_phase_expired(shttpPhaseClock *clock, shttpConnection *connection) {
+    // an idle persistent connection is just closed, a client that is too
+    // slow sending its request is told so
+    LOG(DEBUG, "shttp: client timed out (phase %d)", clock->phase);
+    if (clock->phase == shttpParserPhaseIdle) {
+        return false;
+    }
+    shttp_write_response(shttp_empty_response(shttpStatusRequestTimeout), connection, false, false);
+    return true;
+}
@@ -4,6 +4,13 @@
 #include <stdint.h>
 
 char *shttp_url_decode_buffer(char *buffer, uint8_t len);
+
+// value of a hex digit, -1 if `c` is none
+int8_t shttp_hex_value(char c);
+
+// decode `len` bytes of buffer in place and zero terminate the result,
+// returns the decoded length
+uint16_t shttp_url_decode_in_place(char *buffer, uint16_t len);
 char *shttp_url_encode_buffer(char *buffer, uint8_t len);
 
 #endif /* shttp_urlcoder_h_included */
\ No newline at end of file
@@ -3,34 +3,56 @@
 #include <stdint.h>
 #include <c_types.h>
 
-ICACHE_FLASH_ATTR char *shttp_url_decode_buffer(char *buffer, uint8_t len) {
-    // allocate output buffer and exit if not enough memory
-    char *output = malloc(len + 1);
-    if (output == NULL) {
-        return NULL;
+#include "urlcoder.h"
+
+ICACHE_FLASH_ATTR int8_t shttp_hex_value(char c) {
+    if ((c >= '0') && (c <= '9')) {
+        return c - '0';
+    }
+    if ((c >= 'a') && (c <= 'f')) {
+        return c - 'a' + 10;
     }
+    if ((c >= 'A') && (c <= 'F')) {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
 
-    // copy bytes over to output buffer
-    uint8_t j = 0;
-    for (uint8_t i = 0; i < len; i++) {
-        if (buffer[i] == '%') {
+ICACHE_FLASH_ATTR uint16_t shttp_url_decode_in_place(char *buffer, uint16_t len) {
+    // the output is never longer than the input, so it is written over
+    // the input
+    uint16_t j = 0;
+    for (uint16_t i = 0; i < len; i++) {
+        if ((buffer[i] == '%') && (i + 2 < len) && (shttp_hex_value(buffer[i + 1]) >= 0) && (shttp_hex_value(buffer[i + 2]) >= 0)) {
             // decode %xx where xx is a hex number
-            output[j++] = (char)strtol(buffer + i, NULL, 16);
+            buffer[j++] = (char)((shttp_hex_value(buffer[i + 1]) << 4) | shttp_hex_value(buffer[i + 2]));
             i += 2;
         } else if (buffer[i] == '+') {
             // plus will get decoded to space
-            output[j++] = ' ';
+            buffer[j++] = ' ';
         } else {
             // all other characters will stay as is (yes that's possibly
             // naive and too simple)
-            output[j++] = buffer[i];
+            buffer[j++] = buffer[i];
         }
     }
     // zero terminate buffer
-    output[j++] = '\0';
+    buffer[j] = '\0';
+
+    return j;
+}
+
+ICACHE_FLASH_ATTR char *shttp_url_decode_buffer(char *buffer, uint8_t len) {
+    // allocate output buffer and exit if not enough memory
+    char *output = malloc(len + 1);
+    if (output == NULL) {
+        return NULL;
+    }
+    memcpy(output, buffer, len);
 
     // shrink buffer to conserve memory
-    return realloc(output, j);
+    uint16_t j = shttp_url_decode_in_place(output, len);
+    return realloc(output, j + 1);
 }
 
 ICACHE_FLASH_ATTR char *shttp_url_decode(char *value) {
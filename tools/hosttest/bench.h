@@ -0,0 +1,17 @@
+#ifndef shttp_hosttest_bench_h_included
+#define shttp_hosttest_bench_h_included
+
+// Wall clock for the benchmarks, they are built optimized and without
+// the sanitizers, see `make bench`
+
+#include <stdint.h>
+#include <time.h>
+
+// nanoseconds since some fixed point in time
+static inline uint64_t bench_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+#endif /* shttp_hosttest_bench_h_included */
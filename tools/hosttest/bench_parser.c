@@ -0,0 +1,158 @@
+// Parser throughput on a fixed corpus of requests. `make bench` builds
+// this once against the library and once against the library before
+// the word-at-a-time scanner, which compared the method with a chain of
+// strncmp calls and looked at every byte of a token on its own
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "simplehttp/http.h"
+#include "parser.h"
+#include "response.h"
+#if __has_include("routetree.h")
+#include "routetree.h"
+#endif
+
+#include "bench.h"
+#include "mock.h"
+
+#ifndef BENCH_NAME
+#define BENCH_NAME "bench_parser"
+#endif
+
+// bytes parsed per measurement
+#define BENCH_BYTES (16 * 1024 * 1024)
+
+#define ALL_METHODS (shttpMethodGET | shttpMethodPOST | shttpMethodPUT | shttpMethodPATCH | shttpMethodDELETE | shttpMethodOPTIONS | shttpMethodHEAD)
+
+static shttpResponse *noContent(shttpRequest *request) {
+    return shttp_empty_response(shttpStatusNoContent);
+}
+
+static const struct {
+    const char *name;
+    const char *request;
+} corpus[] = {
+    { "minimal GET",
+        "GET / HTTP/1.1\r\n"
+        "Host: esp\r\n"
+        "\r\n" },
+    { "browser GET",
+        "GET /index.html HTTP/1.1\r\n"
+        "Host: esp8266.local\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+        "Accept-Language: en-US,en;q=0.5\r\n"
+        "Accept-Encoding: gzip, deflate\r\n"
+        "Connection: keep-alive\r\n"
+        "Upgrade-Insecure-Requests: 1\r\n"
+        "Cache-Control: max-age=0\r\n"
+        "\r\n" },
+    { "query GET",
+        "GET /api/items/42?filter=name%3Dlamp&sort=desc&limit=20&q=living+room HTTP/1.1\r\n"
+        "Host: esp8266.local\r\n"
+        "Accept: application/json\r\n"
+        "\r\n" },
+    { "JSON POST",
+        "POST /api/login HTTP/1.1\r\n"
+        "Host: esp8266.local\r\n"
+        "Content-Type: application/json\r\n"
+        "Content-Length: 43\r\n"
+        "\r\n"
+        "{\"user\":\"admin\",\"password\":\"correct horse\"}" },
+    { "other methods",
+        "PUT /api/items/1 HTTP/1.1\r\nHost: esp\r\nContent-Length: 2\r\n\r\n{}"
+        "PATCH /api/items/2 HTTP/1.1\r\nHost: esp\r\nContent-Length: 2\r\n\r\n{}"
+        "DELETE /api/items/3 HTTP/1.1\r\nHost: esp\r\n\r\n"
+        "OPTIONS /api/items/4 HTTP/1.1\r\nHost: esp\r\n\r\n"
+        "HEAD /api/items/5 HTTP/1.1\r\nHost: esp\r\n\r\n" },
+};
+
+#define CORPUS_SIZE (sizeof(corpus) / sizeof(corpus[0]))
+
+static int count(const char *haystack, const char *needle) {
+    int found = 0;
+    while ((haystack = strstr(haystack, needle)) != NULL) {
+        found++;
+        haystack++;
+    }
+    return found;
+}
+
+// parse the requests back to back in MTU sized segments, returns the
+// nanoseconds per byte
+static double ns_per_byte(shttpConfig *config, const char *requests) {
+    struct netconn *conn = mock_conn();
+    shttpConnection connection = { conn, config, false, NULL };
+    shttpParserState *parser = shttp_parser_init_state(config);
+    size_t len = strlen(requests);
+
+    size_t parsed = 0;
+    uint64_t start = bench_now();
+    while (parsed < BENCH_BYTES) {
+        for (size_t offset = 0; offset < len; offset += 1460) {
+            size_t segmentLen = (len - offset < 1460) ? len - offset : 1460;
+            if (!shttp_parse(parser, mock_netbuf(requests + offset, segmentLen), &connection)) {
+                // max requests per connection reached
+                shttp_destroy_parser(parser);
+                parser = shttp_parser_init_state(config);
+            }
+        }
+        // every request has to have been answered
+        if ((parsed == 0) && (count(mock_out(conn), "HTTP/1.1 204") != count(requests, " HTTP/1.1\r\n"))) {
+            printf("%s: requests were not answered\n", BENCH_NAME);
+            exit(1);
+        }
+        mock_reset(conn);
+        parsed += len;
+    }
+    uint64_t elapsed = bench_now() - start;
+
+    shttp_destroy_parser(parser);
+    free(conn);
+    return (double)elapsed / parsed;
+}
+
+int main(void) {
+    shttpConfig config = { 0 };
+    config.routes = (shttpRoute *[]){
+        GET("/", noContent),
+        GET("/index.html", noContent),
+        shttp_route(ALL_METHODS, "/api/items/?", noContent),
+        POST("/api/login", noContent),
+        NULL
+    };
+#if __has_include("routetree.h")
+    if (!shttp_route_tree_build(&config)) {
+        printf("%s: could not compile routes\n", BENCH_NAME);
+        return 1;
+    }
+#endif
+
+    // the whole corpus once, so every request is looked at the same way
+    size_t totalLen = 0;
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+        totalLen += strlen(corpus[i].request);
+    }
+    char *all = malloc(totalLen + 1);
+    all[0] = '\0';
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+        strcat(all, corpus[i].request);
+    }
+
+    printf("%s: ns per byte\n", BENCH_NAME);
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+        printf("%16s %8.2f\n", corpus[i].name, ns_per_byte(&config, corpus[i].request));
+    }
+    printf("%16s %8.2f\n", "whole corpus", ns_per_byte(&config, all));
+    free(all);
+
+#if __has_include("routetree.h")
+    shttp_route_tree_destroy(&config);
+#endif
+    for (int i = 0; config.routes[i] != NULL; i++) {
+        free(config.routes[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,160 @@
+// Route lookup against the number of routes: the linear matcher the
+// route tree replaced compares the path with every route in turn, the
+// tree only follows the path. Looked up are the first route, the last
+// route and a path without route
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "simplehttp/http.h"
+#include "routetree.h"
+
+#include "bench.h"
+#include "mock.h"
+
+// lookups per measurement
+#define BENCH_LOOKUPS 200000
+
+#define BENCH_MAX_ROUTES 160
+
+// the matcher before the route tree, without its trace logging. The
+// first matching route in the list wins
+static shttpRoute *linear_find_route(shttpConfig *config, char *path, shttpMethod method, shttpMethod *allowed) {
+    uint8_t pathLen = strlen(path);
+
+    if ((config->appendSlashes) && (pathLen > 0)) {
+        if (path[pathLen - 1] == '/') {
+            path[pathLen - 1] = '\0';
+            pathLen--;
+        }
+    }
+
+    uint8_t currentRoute = 0;
+    shttpRoute *route = config->routes[currentRoute];
+    while(route != NULL) {
+        uint8_t routeLen = strlen(route->path);
+
+        bool found = true;
+        uint8_t pathIndex = 0, routeIndex = 0;
+        for (; pathIndex < pathLen; pathIndex++) {
+            if (routeIndex >= routeLen) {
+                found = false;
+                break;
+            }
+
+            if (route->path[routeIndex] == '?') {
+                // found parameter, skip path to next slash or end
+                for(uint8_t i = 0; i < pathLen - pathIndex; i++) {
+                    if ((path[pathIndex + i] == '/') || (path[pathIndex + i] == ' ') || (i == pathLen - pathIndex - 1)) {
+                        pathIndex += i;
+                        break;
+                    }
+                }
+
+                routeIndex++;
+                continue;
+            } else if (route->path[routeIndex] == '*') {
+                found = true;
+                routeIndex++;
+                break;
+            } else if (route->path[routeIndex] != path[pathIndex]) {
+                found = false;
+                break;
+            }
+            routeIndex++;
+        }
+
+        if (routeIndex < routeLen) {
+            found = false;
+        }
+
+        if (found) {
+            // check if the method matches
+            if ((route->allowedMethods & method) != 0) {
+                break;
+            }
+
+            // remember the methods the path allows for a 405 response
+            if (allowed != NULL) {
+                *allowed |= route->allowedMethods;
+            }
+        }
+
+        currentRoute++;
+        route = config->routes[currentRoute];
+    }
+
+    return route;
+}
+
+static shttpResponse *noContent(shttpRequest *request) {
+    return shttp_empty_response(shttpStatusNoContent);
+}
+
+// nanoseconds per lookup of `path`, both matchers have to find `expected`
+static double ns_per_lookup(shttpConfig *config, const char *path, shttpRoute *expected, bool tree) {
+    char buffer[64];
+    shttpMethod allowed;
+    shttpRoute *route = NULL;
+
+    uint64_t start = bench_now();
+    for (int i = 0; i < BENCH_LOOKUPS; i++) {
+        strcpy(buffer, path);
+        allowed = 0;
+        if (tree) {
+            route = shttp_route_tree_find(config, buffer, shttpMethodGET, &allowed, NULL);
+        } else {
+            route = linear_find_route(config, buffer, shttpMethodGET, &allowed);
+        }
+    }
+    uint64_t elapsed = bench_now() - start;
+
+    if (route != expected) {
+        printf("bench_routes: %s matcher found the wrong route for %s\n", (tree) ? "tree" : "linear", path);
+        exit(1);
+    }
+    return (double)elapsed / BENCH_LOOKUPS;
+}
+
+int main(void) {
+    static char paths[BENCH_MAX_ROUTES][32];
+    shttpRoute *routes[BENCH_MAX_ROUTES + 1];
+
+    printf("bench_routes: ns per lookup, linear / tree\n");
+    printf("%7s %17s %17s %17s\n", "routes", "first route", "last route", "no route");
+    for (int numRoutes = 5; numRoutes <= BENCH_MAX_ROUTES; numRoutes *= 2) {
+        for (int i = 0; i < numRoutes; i++) {
+            sprintf(paths[i], "/api/v1/item%d/?", i);
+            routes[i] = GET(paths[i], noContent);
+        }
+        routes[numRoutes] = NULL;
+
+        shttpConfig config = { 0 };
+        config.routes = routes;
+        if (!shttp_route_tree_build(&config)) {
+            printf("bench_routes: could not compile routes\n");
+            return 1;
+        }
+
+        char last[32];
+        sprintf(last, "/api/v1/item%d/x", numRoutes - 1);
+        const char *lookups[] = { "/api/v1/item0/x", last, "/api/v1/none/x" };
+        shttpRoute *expected[] = { routes[0], routes[numRoutes - 1], NULL };
+
+        printf("%7d", numRoutes);
+        for (int i = 0; i < 3; i++) {
+            double linear = ns_per_lookup(&config, lookups[i], expected[i], false);
+            double tree = ns_per_lookup(&config, lookups[i], expected[i], true);
+            printf(" %8.0f / %6.0f", linear, tree);
+        }
+        printf("\n");
+
+        shttp_route_tree_destroy(&config);
+        for (int i = 0; i < numRoutes; i++) {
+            free(routes[i]);
+        }
+    }
+
+    return 0;
+}
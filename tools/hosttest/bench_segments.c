@@ -0,0 +1,89 @@
+// Segment sizes: the same request is parsed from 1 byte, 16 byte and MTU
+// sized segments. The parser looks at every byte once, however the
+// request is split, so the time per byte does not grow with the request.
+// Every request and every segment only add a fixed cost
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "simplehttp/http.h"
+#include "parser.h"
+#include "routetree.h"
+#include "response.h"
+
+#include "bench.h"
+#include "mock.h"
+
+// bytes parsed per measurement
+#define BENCH_BYTES (8 * 1024 * 1024)
+
+static shttpResponse *hello(shttpRequest *request) {
+    return shttp_text_response(shttpStatusOK, "Hello", false);
+}
+
+// GET request with `numHeaders` headers of about 40 bytes each
+static char *build_request(int numHeaders) {
+    char *request = malloc(64 + numHeaders * 48);
+    char *ptr = request + sprintf(request, "GET /hello?name=value&x=%%41 HTTP/1.1\r\n");
+    for (int i = 0; i < numHeaders; i++) {
+        ptr += sprintf(ptr, "X-Header-%02d: some header value %08d\r\n", i, i);
+    }
+    sprintf(ptr, "\r\n");
+    return request;
+}
+
+static double ns_per_byte(shttpConfig *config, const char *request, size_t segmentSize) {
+    struct netconn *conn = mock_conn();
+    shttpConnection connection = { conn, config, false, NULL };
+    shttpParserState *parser = shttp_parser_init_state(config);
+    size_t len = strlen(request);
+
+    size_t parsed = 0;
+    uint64_t start = bench_now();
+    while (parsed < BENCH_BYTES) {
+        for (size_t offset = 0; offset < len; offset += segmentSize) {
+            size_t segmentLen = (len - offset < segmentSize) ? len - offset : segmentSize;
+            if (!shttp_parse(parser, mock_netbuf(request + offset, segmentLen), &connection)) {
+                // max requests per connection reached
+                shttp_destroy_parser(parser);
+                parser = shttp_parser_init_state(config);
+            }
+        }
+        mock_reset(conn);
+        parsed += len;
+    }
+    uint64_t elapsed = bench_now() - start;
+
+    shttp_destroy_parser(parser);
+    free(conn);
+    return (double)elapsed / parsed;
+}
+
+int main(void) {
+    shttpConfig config = { 0 };
+    config.routes = (shttpRoute *[]){ GET("/hello", hello), NULL };
+    if (!shttp_route_tree_build(&config)) {
+        printf("bench_segments: could not compile routes\n");
+        return 1;
+    }
+
+    const size_t segmentSizes[] = { 1, 16, 1460 };
+    const int numHeaders[] = { 2, 10, 40 };
+
+    printf("bench_segments: ns per byte by request size and segment size\n");
+    printf("%14s %10s %10s %10s\n", "request bytes", "1", "16", "1460");
+    for (int i = 0; i < 3; i++) {
+        char *request = build_request(numHeaders[i]);
+        printf("%14zu", strlen(request));
+        for (int j = 0; j < 3; j++) {
+            printf(" %10.2f", ns_per_byte(&config, request, segmentSizes[j]));
+        }
+        printf("\n");
+        free(request);
+    }
+
+    shttp_route_tree_destroy(&config);
+    free(config.routes[0]);
+    return 0;
+}
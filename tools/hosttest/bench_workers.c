@@ -0,0 +1,83 @@
+// Throughput against the number of data processing tasks. server.c runs
+// on pthreads, every request waits for a millisecond in its route, as
+// for a slow peripheral or a slow client. The target has one core, so
+// only waiting overlaps there, not computing: the route does not compute.
+// A SERIALIZED route never runs concurrently and stays at one task
+// whatever the size of the pool
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "simplehttp/http.h"
+
+#include "bench.h"
+#include "pool.h"
+
+// requests per measurement
+#define BENCH_REQUESTS 500
+
+// time a request waits in its route, in microseconds
+#define BENCH_WAIT 1000
+
+#define BENCH_QUEUE_DEPTH 32
+
+static shttpResponse *slowRoute(shttpRequest *request) {
+    usleep(BENCH_WAIT);
+    return shttp_text_response(shttpStatusOK, "Hello", false);
+}
+
+static void *listen_task(void *config) {
+    shttp_listen(config);
+    return NULL;
+}
+
+// requests per second with `workers` tasks
+static double requests_per_second(uint8_t workers, const char *request) {
+    shttpConfig config = { 0 };
+    config.port = 80;
+    config.workers = workers;
+    config.queueDepth = BENCH_QUEUE_DEPTH;
+    config.routes = (shttpRoute *[]){
+        GET("/wait", slowRoute),
+        SERIALIZED(GET("/serialized", slowRoute)),
+        NULL
+    };
+
+    pthread_t listener;
+    pthread_create(&listener, NULL, listen_task, &config);
+
+    // never more connections than the queue takes, none is shed
+    uint32_t answered = pool_answered();
+    uint64_t start = bench_now();
+    for (int i = 0; i < BENCH_REQUESTS; i++) {
+        pool_wait_open(BENCH_QUEUE_DEPTH - 1, 60000);
+        pool_connect(config.port, request);
+    }
+    pool_wait_open(0, 60000);
+    uint64_t elapsed = bench_now() - start;
+
+    shttp_stop(1000);
+    pthread_join(listener, NULL);
+
+    if (pool_answered() - answered != BENCH_REQUESTS) {
+        printf("bench_workers: %u of %d requests were answered\n", pool_answered() - answered, BENCH_REQUESTS);
+        exit(1);
+    }
+    return BENCH_REQUESTS / (elapsed / 1e9);
+}
+
+int main(void) {
+    const uint8_t workers[] = { 1, 2, 4, 8, 16 };
+
+    printf("bench_workers: requests per second, %d us in the route\n", BENCH_WAIT);
+    printf("%8s %10s %10s\n", "workers", "route", "SERIALIZED");
+    for (size_t i = 0; i < sizeof(workers); i++) {
+        printf("%8d", workers[i]);
+        printf(" %10.0f", requests_per_second(workers[i], "GET /wait HTTP/1.1\r\nConnection: close\r\n\r\n"));
+        printf(" %10.0f", requests_per_second(workers[i], "GET /serialized HTTP/1.1\r\nConnection: close\r\n\r\n"));
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,60 @@
+// Coalesced responses: head and a small body leave in one write, bodies
+// that do not fit SHTTP_COALESCE_SIZE and streamed bodies are written on
+// their own
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "simplehttp/http.h"
+#include "response.h"
+
+#include "mock.h"
+
+static char *stream(uint32_t position, uint32_t *len, void *userData) {
+    if (position >= 10) {
+        return NULL;
+    }
+    char *chunk = malloc(5);
+    memcpy(chunk, "abcde", 5);
+    *len = 5;
+    return chunk;
+}
+
+// write the response and compare the number of writes and the body sent
+static int check(const char *name, shttpResponse *response, int writes, const char *body) {
+    shttpConfig config = { 0 };
+    struct netconn *conn = mock_conn();
+    shttpConnection connection = { conn, &config, false, NULL };
+
+    shttp_write_response(response, &connection, true, false);
+
+    int failed = 0;
+    const char *sent = strstr(mock_out(conn), "\r\n\r\n");
+    if (mock_writes(conn) != writes) {
+        printf("coalesce: %s took %d writes instead of %d\n", name, mock_writes(conn), writes);
+        failed = 1;
+    }
+    if ((sent == NULL) || (strcmp(sent + 4, body) != 0)) {
+        printf("coalesce: %s sent the wrong body\n", name);
+        failed = 1;
+    }
+    free(conn);
+    return failed;
+}
+
+int main(void) {
+    char *large = malloc(SHTTP_COALESCE_SIZE + 1);
+    memset(large, 'x', SHTTP_COALESCE_SIZE);
+    large[SHTTP_COALESCE_SIZE] = '\0';
+
+    int failed = 0;
+    failed |= check("small body", shttp_text_response(shttpStatusOK, "hello", false), 1, "hello");
+    failed |= check("no body", shttp_empty_response(shttpStatusNoContent), 1, "");
+    failed |= check("large body", shttp_text_response(shttpStatusOK, large, false), 2, large);
+    failed |= check("streamed body", shttp_download_callback_response(shttpStatusOK, 10, NULL, stream, NULL, NULL), 3, "abcdeabcde");
+    free(large);
+
+    printf("coalesce: %s\n", (failed) ? "FAILED" : "ok");
+    return failed;
+}
@@ -0,0 +1,97 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <c_types.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include "mock.h"
+
+#define MOCK_OUTPUT_SIZE 65536
+
+struct netconn {
+    char out[MOCK_OUTPUT_SIZE];
+    size_t outLen;
+    int writes;
+    bool stalled;
+};
+
+// defined by server.c, which is not part of the tests
+xSemaphoreHandle shttpSerializedRouteLock;
+volatile bool shttpServerDraining;
+
+static portTickType ticks;
+
+struct netconn *mock_conn(void) {
+    return calloc(1, sizeof(struct netconn));
+}
+
+const char *mock_out(struct netconn *conn) {
+    conn->out[conn->outLen] = '\0';
+    return conn->out;
+}
+
+int mock_writes(struct netconn *conn) {
+    return conn->writes;
+}
+
+void mock_reset(struct netconn *conn) {
+    conn->outLen = 0;
+    conn->writes = 0;
+}
+
+void mock_stall(struct netconn *conn, bool stalled) {
+    conn->stalled = stalled;
+}
+
+void mock_sleep(uint32_t ms) {
+    ticks += ms / portTICK_RATE_MS;
+}
+
+//
+// lwIP
+//
+
+err_t netconn_write_partly(struct netconn *conn, const void *data, size_t size, u8_t flags, size_t *written) {
+    conn->writes++;
+    if (conn->stalled) {
+        if (written != NULL) {
+            *written = 0;
+        }
+        return ERR_WOULDBLOCK;
+    }
+    if (conn->outLen + size >= MOCK_OUTPUT_SIZE) {
+        return ERR_MEM;
+    }
+    memcpy(conn->out + conn->outLen, data, size);
+    conn->outLen += size;
+    if (written != NULL) {
+        *written = size;
+    }
+    return ERR_OK;
+}
+
+//
+// SDK and FreeRTOS, the tests run in one task
+//
+
+uint32_t system_get_free_heap_size(void) {
+    return 40000;
+}
+
+portBASE_TYPE xSemaphoreTake(xSemaphoreHandle semaphore, portTickType wait) {
+    return pdTRUE;
+}
+
+portBASE_TYPE xSemaphoreGive(xSemaphoreHandle semaphore) {
+    return pdTRUE;
+}
+
+portTickType xTaskGetTickCount(void) {
+    return ticks;
+}
+
+void vTaskDelay(portTickType delay) {
+    ticks += delay;
+}
@@ -0,0 +1,34 @@
+#ifndef shttp_hosttest_mock_h_included
+#define shttp_hosttest_mock_h_included
+
+// A client connection that records everything written to it, and
+// received data as the lwIP task would hand it to the server
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <lwip/api.h>
+
+#include "netbuf.h"
+
+// new connection, free it with free()
+struct netconn *mock_conn(void);
+
+// everything written to the connection so far, zero terminated
+const char *mock_out(struct netconn *conn);
+
+// number of netconn_write calls so far
+int mock_writes(struct netconn *conn);
+
+// forget what has been written
+void mock_reset(struct netconn *conn);
+
+// a stalled client takes no data, writes make no progress
+void mock_stall(struct netconn *conn, bool stalled);
+
+// let `ms` milliseconds pass, the tick count only moves on here and in
+// vTaskDelay()
+void mock_sleep(uint32_t ms);
+
+#endif /* shttp_hosttest_mock_h_included */
@@ -0,0 +1,61 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "netbuf.h"
+
+struct netbuf *mock_netbuf(const char *data, size_t len) {
+    struct netbuf *buf = calloc(1, sizeof(struct netbuf));
+    struct pbuf *p = calloc(1, sizeof(struct pbuf));
+    p->payload = malloc((len > 0) ? len : 1);
+    memcpy(p->payload, data, len);
+    p->len = p->tot_len = len;
+    buf->p = buf->ptr = p;
+    return buf;
+}
+
+//
+// lwIP
+//
+
+void netbuf_delete(struct netbuf *buf) {
+    if (buf == NULL) {
+        return;
+    }
+    struct pbuf *p = buf->p;
+    while (p != NULL) {
+        struct pbuf *next = p->next;
+        free(p->payload);
+        free(p);
+        p = next;
+    }
+    free(buf);
+}
+
+err_t netbuf_data(struct netbuf *buf, void **data, u16_t *len) {
+    *data = buf->ptr->payload;
+    *len = buf->ptr->len;
+    return ERR_OK;
+}
+
+s8_t netbuf_next(struct netbuf *buf) {
+    if (buf->ptr->next == NULL) {
+        return -1;
+    }
+    buf->ptr = buf->ptr->next;
+    return (buf->ptr->next != NULL) ? 0 : 1;
+}
+
+void netbuf_first(struct netbuf *buf) {
+    buf->ptr = buf->p;
+}
+
+void netbuf_chain(struct netbuf *head, struct netbuf *tail) {
+    struct pbuf *p = head->p;
+    while (p->next != NULL) {
+        p = p->next;
+    }
+    p->next = tail->p;
+    head->p->tot_len += tail->p->tot_len;
+    head->ptr = head->p;
+    free(tail);
+}
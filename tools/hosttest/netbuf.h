@@ -0,0 +1,14 @@
+#ifndef shttp_hosttest_netbuf_h_included
+#define shttp_hosttest_netbuf_h_included
+
+// Received segments as the lwIP task hands them to the server, shared by
+// mock.c and pool.c
+
+#include <stddef.h>
+
+#include <lwip/api.h>
+
+// received segment holding a copy of `data`, the parser takes it over
+struct netbuf *mock_netbuf(const char *data, size_t len);
+
+#endif /* shttp_hosttest_netbuf_h_included */
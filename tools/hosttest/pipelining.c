@@ -0,0 +1,99 @@
+// Pipelined requests: five requests sent back to back are parsed in
+// every split into segments, from one byte per segment to all at once,
+// and always give the same responses in request order. The response to
+// the HEAD request announces the body but does not send it
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "simplehttp/http.h"
+#include "parser.h"
+#include "routetree.h"
+#include "response.h"
+
+#include "mock.h"
+
+static shttpResponse *hello(shttpRequest *request) {
+    return shttp_text_response(shttpStatusOK, "Hello", false);
+}
+
+static shttpResponse *echo(shttpRequest *request) {
+    char *body = malloc(request->bodyLen + 1);
+    memcpy(body, request->bodyData, request->bodyLen);
+    body[request->bodyLen] = '\0';
+    return shttp_text_response(shttpStatusOK, body, true);
+}
+
+static const char requests[] =
+    "GET /hello HTTP/1.1\r\nHost: x\r\n\r\n"
+    "HEAD /hello HTTP/1.1\r\n\r\n"
+    "POST /echo HTTP/1.1\r\nContent-Length: 4\r\n\r\nabcd"
+    "POST /echo HTTP/1.1\r\nContent-Length: 3\r\n\r\nxyz"
+    "GET /hello HTTP/1.1\r\nConnection: close\r\n\r\n";
+
+// responses to the requests in one go
+static char *parse(shttpConfig *config, size_t segmentSize) {
+    struct netconn *conn = mock_conn();
+    shttpConnection connection = { conn, config, false, NULL };
+    shttpParserState *parser = shttp_parser_init_state(config);
+
+    size_t len = strlen(requests);
+    bool open = true;
+    for (size_t offset = 0; (offset < len) && (open); offset += segmentSize) {
+        size_t segmentLen = (len - offset < segmentSize) ? len - offset : segmentSize;
+        open = shttp_parse(parser, mock_netbuf(requests + offset, segmentLen), &connection);
+    }
+    shttp_destroy_parser(parser);
+
+    char *out = strdup(mock_out(conn));
+    free(conn);
+    return out;
+}
+
+int main(void) {
+    shttpConfig config = { 0 };
+    config.routes = (shttpRoute *[]){ shttp_route(shttpMethodGET | shttpMethodHEAD, "/hello", hello), POST("/echo", echo), NULL };
+    if (!shttp_route_tree_build(&config)) {
+        printf("pipelining: could not compile routes\n");
+        return 1;
+    }
+
+    int failed = 0;
+    char *expected = parse(&config, strlen(requests));
+    const char *order[] = { "Hello", "HTTP/1.1 ", "abcd", "xyz", "Hello" };
+    const char *at = expected;
+    for (int i = 0; i < 5; i++) {
+        const char *head = at;
+        at = strstr(at, "\r\n\r\n");
+        if ((at == NULL) || (strncmp(at + 4, order[i], strlen(order[i])) != 0)) {
+            printf("pipelining: response %d is not followed by '%s'\n", i + 1, order[i]);
+            failed = 1;
+            break;
+        }
+        const char *length = strstr(head, "Content-Length: 5\r\n");
+        if ((i == 1) && ((length == NULL) || (length > at))) {
+            printf("pipelining: response to HEAD has no Content-Length\n");
+            failed = 1;
+        }
+        at += 4;
+    }
+
+    for (size_t segmentSize = 1; segmentSize < strlen(requests); segmentSize++) {
+        char *out = parse(&config, segmentSize);
+        if (strcmp(out, expected) != 0) {
+            printf("pipelining: responses differ with %zu byte segments\n", segmentSize);
+            failed = 1;
+        }
+        free(out);
+    }
+    free(expected);
+
+    shttp_route_tree_destroy(&config);
+    for (int i = 0; config.routes[i] != NULL; i++) {
+        free(config.routes[i]);
+    }
+
+    printf("pipelining: %s\n", (failed) ? "FAILED" : "ok");
+    return failed;
+}
@@ -0,0 +1,463 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <c_types.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include "netbuf.h"
+#include "pool.h"
+
+// connections a listener holds before pool_connect() waits, every one
+// of them is one event in the accept queue of server.c
+#define POOL_BACKLOG 4
+
+struct netconn {
+    netconn_callback callback;
+    int recvTimeout;
+
+    // listening connections
+    u16_t port;
+    bool listening;
+    bool closed;
+    struct netconn *backlog[POOL_BACKLOG];
+    uint8_t backlogLen;
+    struct netconn *next;
+
+    // client connections, the request is received at once
+    const char *request;
+    bool received;
+    char status[16];
+    size_t statusLen;
+};
+
+typedef struct _poolQueue {
+    pthread_cond_t changed;
+    uint8_t *items;
+    portUBASE_TYPE itemSize;
+    portUBASE_TYPE length;
+    portUBASE_TYPE first;
+    portUBASE_TYPE count;
+} poolQueue;
+
+typedef struct _poolSemaphore {
+    pthread_cond_t changed;
+    portUBASE_TYPE maxCount;
+    portUBASE_TYPE count;
+} poolSemaphore;
+
+typedef struct _poolTask {
+    pthread_t thread;
+    pdTASK_CODE code;
+    void *parameters;
+} poolTask;
+
+// one lock for all queues, semaphores and connections
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t connsChanged;
+
+// taskENTER_CRITICAL() does not nest in the library
+static pthread_mutex_t critical = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread poolTask *currentTask;
+
+static struct netconn *listeners;
+static uint32_t openConns;
+static uint32_t answered;
+
+// condition variables time out on the monotonic clock like the ticks
+static void cond_init(pthread_cond_t *cond) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+__attribute__((constructor)) static void pool_init(void) {
+    cond_init(&connsChanged);
+}
+
+static struct timespec deadline_after(uint32_t ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (long)(ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    return deadline;
+}
+
+// wait for a change with the lock held, returns false once the deadline
+// passed. `wait` is in ticks as FreeRTOS takes it, the deadline has to
+// be computed from it before the first call
+static bool wait_for_change(pthread_cond_t *cond, portTickType wait, const struct timespec *deadline) {
+    if (wait == 0) {
+        return false;
+    }
+    if (wait == portMAX_DELAY) {
+        pthread_cond_wait(cond, &lock);
+        return true;
+    }
+    return (pthread_cond_timedwait(cond, &lock, deadline) != ETIMEDOUT);
+}
+
+static struct timespec deadline_in_ticks(portTickType wait) {
+    return deadline_after((wait == portMAX_DELAY) ? 0 : wait * portTICK_RATE_MS);
+}
+
+//
+// the test side of the network
+//
+
+static struct netconn *find_listener(u16_t port) {
+    for (struct netconn *conn = listeners; conn != NULL; conn = conn->next) {
+        if ((conn->port == port) && (!conn->closed)) {
+            return conn;
+        }
+    }
+    return NULL;
+}
+
+void pool_connect(uint16_t port, const char *request) {
+    pthread_mutex_lock(&lock);
+    struct netconn *listener;
+    while (((listener = find_listener(port)) == NULL) || (listener->backlogLen == POOL_BACKLOG)) {
+        pthread_cond_wait(&connsChanged, &lock);
+    }
+
+    struct netconn *conn = calloc(1, sizeof(struct netconn));
+    conn->request = request;
+    listener->backlog[listener->backlogLen++] = conn;
+    openConns++;
+    pthread_mutex_unlock(&lock);
+
+    // as the lwIP task announces a connection to accept
+    listener->callback(listener, NETCONN_EVT_RCVPLUS, 0);
+}
+
+bool pool_wait_open(uint32_t max, uint32_t timeout) {
+    struct timespec deadline = deadline_after(timeout);
+
+    pthread_mutex_lock(&lock);
+    while (openConns > max) {
+        if (pthread_cond_timedwait(&connsChanged, &lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    bool done = (openConns <= max);
+    pthread_mutex_unlock(&lock);
+    return done;
+}
+
+uint32_t pool_answered(void) {
+    pthread_mutex_lock(&lock);
+    uint32_t result = answered;
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+//
+// lwIP
+//
+
+struct netconn *netconn_new_with_callback(enum netconn_type type, netconn_callback callback) {
+    struct netconn *conn = calloc(1, sizeof(struct netconn));
+    if (conn != NULL) {
+        conn->callback = callback;
+    }
+    return conn;
+}
+
+// a client connection is gone, count its answer
+static void client_closed(struct netconn *conn) {
+    if ((conn->statusLen >= 12) && (strncmp(conn->status, "HTTP/1.1 200", 12) == 0)) {
+        answered++;
+    }
+    openConns--;
+    free(conn);
+}
+
+err_t netconn_delete(struct netconn *conn) {
+    pthread_mutex_lock(&lock);
+    if (conn->listening) {
+        for (struct netconn **ptr = &listeners; *ptr != NULL; ptr = &(*ptr)->next) {
+            if (*ptr == conn) {
+                *ptr = conn->next;
+                break;
+            }
+        }
+        for (uint8_t i = 0; i < conn->backlogLen; i++) {
+            client_closed(conn->backlog[i]);
+        }
+        free(conn);
+    } else {
+        client_closed(conn);
+    }
+    pthread_cond_broadcast(&connsChanged);
+    pthread_mutex_unlock(&lock);
+    return ERR_OK;
+}
+
+err_t netconn_bind(struct netconn *conn, ip_addr_t *addr, u16_t port) {
+    conn->port = port;
+    return ERR_OK;
+}
+
+err_t netconn_listen(struct netconn *conn) {
+    pthread_mutex_lock(&lock);
+    conn->listening = true;
+    conn->next = listeners;
+    listeners = conn;
+    pthread_cond_broadcast(&connsChanged);
+    pthread_mutex_unlock(&lock);
+    return ERR_OK;
+}
+
+err_t netconn_accept(struct netconn *conn, struct netconn **incoming) {
+    portTickType wait = (conn->recvTimeout > 0) ? (conn->recvTimeout + portTICK_RATE_MS - 1) / portTICK_RATE_MS : portMAX_DELAY;
+    struct timespec deadline = deadline_in_ticks(wait);
+
+    pthread_mutex_lock(&lock);
+    while ((conn->backlogLen == 0) && (!conn->closed)) {
+        if (!wait_for_change(&connsChanged, wait, &deadline)) {
+            break;
+        }
+    }
+
+    err_t err = ERR_TIMEOUT;
+    if (conn->closed) {
+        err = ERR_CLSD;
+    } else if (conn->backlogLen > 0) {
+        *incoming = conn->backlog[0];
+        conn->backlogLen--;
+        memmove(conn->backlog, conn->backlog + 1, conn->backlogLen * sizeof(struct netconn *));
+        pthread_cond_broadcast(&connsChanged);
+        err = ERR_OK;
+    }
+    pthread_mutex_unlock(&lock);
+    return err;
+}
+
+// the request arrives in one segment, then the client closes its side
+err_t netconn_recv(struct netconn *conn, struct netbuf **buf) {
+    if (conn->received) {
+        return ERR_CLSD;
+    }
+    conn->received = true;
+    *buf = mock_netbuf(conn->request, strlen(conn->request));
+    return ERR_OK;
+}
+
+err_t netconn_close(struct netconn *conn) {
+    if (conn->listening) {
+        pthread_mutex_lock(&lock);
+        conn->closed = true;
+        pthread_cond_broadcast(&connsChanged);
+        pthread_mutex_unlock(&lock);
+    }
+    return ERR_OK;
+}
+
+void netconn_set_recvtimeout(struct netconn *conn, int timeout) {
+    conn->recvTimeout = timeout;
+}
+
+// only the status line is kept
+err_t netconn_write_partly(struct netconn *conn, const void *data, size_t size, u8_t flags, size_t *written) {
+    size_t len = sizeof(conn->status) - conn->statusLen;
+    if (len > size) {
+        len = size;
+    }
+    memcpy(conn->status + conn->statusLen, data, len);
+    conn->statusLen += len;
+    if (written != NULL) {
+        *written = size;
+    }
+    return ERR_OK;
+}
+
+//
+// SDK and FreeRTOS, every task is a thread. Stack sizes and priorities
+// are left to the host
+//
+
+uint32_t system_get_free_heap_size(void) {
+    return 1024 * 1024;
+}
+
+xQueueHandle xQueueCreate(portUBASE_TYPE length, portUBASE_TYPE itemSize) {
+    poolQueue *queue = calloc(1, sizeof(poolQueue));
+    if (queue == NULL) {
+        return NULL;
+    }
+    queue->items = malloc(length * itemSize);
+    if (queue->items == NULL) {
+        free(queue);
+        return NULL;
+    }
+    queue->itemSize = itemSize;
+    queue->length = length;
+    cond_init(&queue->changed);
+    return queue;
+}
+
+void vQueueDelete(xQueueHandle handle) {
+    poolQueue *queue = handle;
+    pthread_cond_destroy(&queue->changed);
+    free(queue->items);
+    free(queue);
+}
+
+portBASE_TYPE xQueueSendToBack(xQueueHandle handle, const void *item, portTickType wait) {
+    poolQueue *queue = handle;
+    struct timespec deadline = deadline_in_ticks(wait);
+
+    pthread_mutex_lock(&lock);
+    while (queue->count == queue->length) {
+        if ((!wait_for_change(&queue->changed, wait, &deadline)) && (queue->count == queue->length)) {
+            pthread_mutex_unlock(&lock);
+            return pdFAIL;
+        }
+    }
+    portUBASE_TYPE index = (queue->first + queue->count) % queue->length;
+    memcpy(queue->items + index * queue->itemSize, item, queue->itemSize);
+    queue->count++;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&lock);
+    return pdPASS;
+}
+
+portBASE_TYPE xQueueReceive(xQueueHandle handle, void *item, portTickType wait) {
+    poolQueue *queue = handle;
+    struct timespec deadline = deadline_in_ticks(wait);
+
+    pthread_mutex_lock(&lock);
+    while (queue->count == 0) {
+        if ((!wait_for_change(&queue->changed, wait, &deadline)) && (queue->count == 0)) {
+            pthread_mutex_unlock(&lock);
+            return pdFALSE;
+        }
+    }
+    memcpy(item, queue->items + queue->first * queue->itemSize, queue->itemSize);
+    queue->first = (queue->first + 1) % queue->length;
+    queue->count--;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&lock);
+    return pdTRUE;
+}
+
+xSemaphoreHandle xSemaphoreCreateCounting(portUBASE_TYPE maxCount, portUBASE_TYPE initialCount) {
+    poolSemaphore *semaphore = calloc(1, sizeof(poolSemaphore));
+    if (semaphore == NULL) {
+        return NULL;
+    }
+    semaphore->maxCount = maxCount;
+    semaphore->count = initialCount;
+    cond_init(&semaphore->changed);
+    return semaphore;
+}
+
+// no priority inheritance, all tasks run at the same priority
+xSemaphoreHandle xSemaphoreCreateMutex(void) {
+    return xSemaphoreCreateCounting(1, 1);
+}
+
+void vSemaphoreDelete(xSemaphoreHandle handle) {
+    poolSemaphore *semaphore = handle;
+    pthread_cond_destroy(&semaphore->changed);
+    free(semaphore);
+}
+
+portBASE_TYPE xSemaphoreTake(xSemaphoreHandle handle, portTickType wait) {
+    poolSemaphore *semaphore = handle;
+    struct timespec deadline = deadline_in_ticks(wait);
+
+    pthread_mutex_lock(&lock);
+    while (semaphore->count == 0) {
+        if ((!wait_for_change(&semaphore->changed, wait, &deadline)) && (semaphore->count == 0)) {
+            pthread_mutex_unlock(&lock);
+            return pdFALSE;
+        }
+    }
+    semaphore->count--;
+    pthread_mutex_unlock(&lock);
+    return pdTRUE;
+}
+
+portBASE_TYPE xSemaphoreGive(xSemaphoreHandle handle) {
+    poolSemaphore *semaphore = handle;
+
+    pthread_mutex_lock(&lock);
+    if (semaphore->count == semaphore->maxCount) {
+        pthread_mutex_unlock(&lock);
+        return pdFALSE;
+    }
+    semaphore->count++;
+    pthread_cond_signal(&semaphore->changed);
+    pthread_mutex_unlock(&lock);
+    return pdTRUE;
+}
+
+static void *run_task(void *userData) {
+    currentTask = userData;
+    currentTask->code(currentTask->parameters);
+
+    // FreeRTOS tasks never return, they delete themselves
+    abort();
+    return NULL;
+}
+
+portBASE_TYPE xTaskCreate(pdTASK_CODE code, const char *name, uint16_t stackDepth, void *parameters, portBASE_TYPE priority, xTaskHandle *handle) {
+    poolTask *task = calloc(1, sizeof(poolTask));
+    if (task == NULL) {
+        return pdFAIL;
+    }
+    task->code = code;
+    task->parameters = parameters;
+    if (pthread_create(&task->thread, NULL, run_task, task) != 0) {
+        free(task);
+        return pdFAIL;
+    }
+    pthread_detach(task->thread);
+    if (handle != NULL) {
+        *handle = task;
+    }
+    return pdPASS;
+}
+
+void vTaskDelete(xTaskHandle handle) {
+    poolTask *task = (handle != NULL) ? handle : currentTask;
+    if (task == currentTask) {
+        free(task);
+        pthread_exit(NULL);
+    }
+    pthread_cancel(task->thread);
+    free(task);
+}
+
+void vTaskDelay(portTickType ticks) {
+    struct timespec delay = { ticks * portTICK_RATE_MS / 1000, (long)(ticks * portTICK_RATE_MS % 1000) * 1000000 };
+    nanosleep(&delay, NULL);
+}
+
+portTickType xTaskGetTickCount(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (portTickType)(((uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000) / portTICK_RATE_MS);
+}
+
+void vPortEnterCritical(void) {
+    pthread_mutex_lock(&critical);
+}
+
+void vPortExitCritical(void) {
+    pthread_mutex_unlock(&critical);
+}
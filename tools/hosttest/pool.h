@@ -0,0 +1,24 @@
+#ifndef shttp_hosttest_pool_h_included
+#define shttp_hosttest_pool_h_included
+
+// FreeRTOS on pthreads and a loopback network, so server.c runs with its
+// accepting task and the whole pool of data processing tasks. Clients
+// send one request and close their side, the server answers and closes
+// the connection
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// connect to the server listening on `port` and send `request`, waits
+// until the server listens and has room in its backlog. Only while the
+// server runs
+void pool_connect(uint16_t port, const char *request);
+
+// wait until no more than `max` client connections are open, returns
+// false after `timeout` milliseconds
+bool pool_wait_open(uint32_t max, uint32_t timeout);
+
+// connections answered with 200 and closed by the server so far
+uint32_t pool_answered(void);
+
+#endif /* shttp_hosttest_pool_h_included */
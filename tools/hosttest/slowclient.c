@@ -0,0 +1,168 @@
+// Slow clients: a request trickling in is answered with 408 once the
+// deadline of its phase has passed, received bytes do not restart the
+// clock. An idle persistent connection is just closed, and a response the
+// client does not take is given up after the write timeout
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "simplehttp/http.h"
+#include "parser.h"
+#include "routetree.h"
+#include "response.h"
+#include "server.h"
+
+#include "mock.h"
+
+static int failed;
+
+static shttpResponse *hello(shttpRequest *request) {
+    return shttp_text_response(shttpStatusOK, "Hello", false);
+}
+
+static void expect(bool ok, const char *what) {
+    if (!ok) {
+        printf("slowclient: %s\n", what);
+        failed = 1;
+    }
+}
+
+// hand data to the parser as a received segment, the clock is updated as
+// the data processing tasks do it
+static void receive(shttpParserState *parser, shttpPhaseClock *clock, shttpConnection *connection, const char *data, size_t len) {
+    shttp_parse(parser, mock_netbuf(data, len), connection);
+    shttp_phase_update(clock, parser);
+}
+
+static void header_timeout(shttpConfig *config) {
+    struct netconn *conn = mock_conn();
+    shttpConnection connection = { conn, config, false, NULL };
+    shttpParserState *parser = shttp_parser_init_state(config);
+    shttpPhaseClock clock;
+    shttp_phase_start(&clock, parser);
+
+    // one byte every 100 ms keeps the client busy, but not its deadline
+    const char *request = "GET /hello HTTP/1.1\r\n";
+    receive(parser, &clock, &connection, request, 1);
+    for (int i = 1; i < 10; i++) {
+        mock_sleep(100);
+        receive(parser, &clock, &connection, request + i, 1);
+    }
+    expect(clock.phase == shttpParserPhaseHeaders, "request line is not in the header phase");
+    expect(shttp_phase_remaining(&clock, config) == 100, "trickled bytes moved the header deadline");
+
+    mock_sleep(100);
+    expect(shttp_phase_remaining(&clock, config) == 0, "header deadline did not pass");
+    expect(shttp_phase_expired(&clock, &connection), "late headers were not answered");
+    expect(strncmp(mock_out(conn), "HTTP/1.1 408", 12) == 0, "late headers got no 408");
+
+    shttp_destroy_parser(parser);
+    free(conn);
+}
+
+static void body_timeout(shttpConfig *config) {
+    struct netconn *conn = mock_conn();
+    shttpConnection connection = { conn, config, false, NULL };
+    shttpParserState *parser = shttp_parser_init_state(config);
+    shttpPhaseClock clock;
+    shttp_phase_start(&clock, parser);
+
+    // the body has its own deadline, starting with its first byte
+    const char *request = "POST /hello HTTP/1.1\r\nContent-Length: 10\r\n\r\nabc";
+    receive(parser, &clock, &connection, request, strlen(request));
+    expect(clock.phase == shttpParserPhaseBody, "request is not in the body phase");
+
+    mock_sleep(1500);
+    receive(parser, &clock, &connection, "d", 1);
+    expect(shttp_phase_remaining(&clock, config) == 500, "header deadline used for the body");
+
+    mock_sleep(500);
+    expect(shttp_phase_remaining(&clock, config) == 0, "body deadline did not pass");
+    expect(shttp_phase_expired(&clock, &connection), "late body was not answered");
+    expect(strncmp(mock_out(conn), "HTTP/1.1 408", 12) == 0, "late body got no 408");
+
+    shttp_destroy_parser(parser);
+    free(conn);
+}
+
+static void idle_timeout(shttpConfig *config) {
+    struct netconn *conn = mock_conn();
+    shttpConnection connection = { conn, config, false, NULL };
+    shttpParserState *parser = shttp_parser_init_state(config);
+    shttpPhaseClock clock;
+    shttp_phase_start(&clock, parser);
+
+    const char *request = "GET /hello HTTP/1.1\r\n\r\n";
+    receive(parser, &clock, &connection, request, strlen(request));
+    expect(clock.phase == shttpParserPhaseIdle, "finished request is not idle");
+    mock_reset(conn);
+
+    // an idle connection is closed without a response, right away while
+    // the server drains
+    shttpServerDraining = true;
+    expect(shttp_phase_remaining(&clock, config) == 0, "draining kept an idle connection");
+    shttpServerDraining = false;
+
+    mock_sleep(4000);
+    expect(shttp_phase_remaining(&clock, config) == 1000, "keep-alive timeout not used when idle");
+    mock_sleep(1000);
+    expect(shttp_phase_remaining(&clock, config) == 0, "keep-alive deadline did not pass");
+    expect(!shttp_phase_expired(&clock, &connection), "idle connection was answered");
+    expect(mock_writes(conn) == 0, "idle connection got a response");
+
+    shttp_destroy_parser(parser);
+    free(conn);
+}
+
+static void write_stall(shttpConfig *config) {
+    struct netconn *conn = mock_conn();
+    mock_stall(conn, true);
+
+    // a data processing task gives up after the write timeout
+    shttpConnection connection = { conn, config, false, NULL };
+    portTickType start = xTaskGetTickCount();
+    bool keepAlive = shttp_write_response(shttp_text_response(shttpStatusOK, "Hello", false), &connection, true, false);
+    uint32_t elapsed = (xTaskGetTickCount() - start) * portTICK_RATE_MS;
+    expect(!keepAlive, "stalled blocking write kept the connection");
+    expect((elapsed >= 3000) && (elapsed <= 3000 + portTICK_RATE_MS), "stalled blocking write not dropped after the write timeout");
+
+    // the engine keeps the response queued until the write timeout
+    connection.nonBlocking = true;
+    shttp_write_response(shttp_text_response(shttpStatusOK, "Hello", false), &connection, true, false);
+    expect(shttp_connection_flush(&connection) == shttpWritePending, "stalled write did not wait");
+    mock_sleep(2990);
+    expect(shttp_connection_flush(&connection) == shttpWritePending, "stalled write dropped early");
+    mock_sleep(10);
+    expect(shttp_connection_flush(&connection) == shttpWriteError, "stalled write not dropped after the write timeout");
+    shttp_connection_discard(&connection);
+
+    free(conn);
+}
+
+int main(void) {
+    shttpConfig config = { 0 };
+    config.routes = (shttpRoute *[]){ shttp_route(shttpMethodGET | shttpMethodPOST, "/hello", hello), NULL };
+    config.headerTimeout = 1000;
+    config.bodyTimeout = 2000;
+    config.writeTimeout = 3000;
+    config.keepAliveTimeout = 5000;
+    if (!shttp_route_tree_build(&config)) {
+        printf("slowclient: could not compile routes\n");
+        return 1;
+    }
+
+    header_timeout(&config);
+    body_timeout(&config);
+    idle_timeout(&config);
+    write_stall(&config);
+
+    shttp_route_tree_destroy(&config);
+    free(config.routes[0]);
+
+    printf("slowclient: %s\n", (failed) ? "FAILED" : "ok");
+    return failed;
+}
@@ -0,0 +1,8 @@
+#ifndef shttp_hosttest_cjson_h_included
+#define shttp_hosttest_cjson_h_included
+
+// the tests build without SHTTP_CJSON, http.h only needs the type
+
+typedef struct cJSON cJSON;
+
+#endif /* shttp_hosttest_cjson_h_included */
@@ -0,0 +1,18 @@
+#ifndef shttp_hosttest_c_types_h_included
+#define shttp_hosttest_c_types_h_included
+
+// the SDK attributes placing code and data in flash mean nothing on the
+// build host
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RODATA_ATTR
+#define STORE_ATTR
+
+typedef uint32_t uint32;
+
+uint32_t system_get_free_heap_size(void);
+
+#endif /* shttp_hosttest_c_types_h_included */
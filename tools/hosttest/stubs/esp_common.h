@@ -0,0 +1,7 @@
+#ifndef shttp_hosttest_esp_common_h_included
+#define shttp_hosttest_esp_common_h_included
+
+#include <stdio.h>
+#include <c_types.h>
+
+#endif /* shttp_hosttest_esp_common_h_included */
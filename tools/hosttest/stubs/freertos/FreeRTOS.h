@@ -0,0 +1,27 @@
+#ifndef shttp_hosttest_freertos_h_included
+#define shttp_hosttest_freertos_h_included
+
+// the parts of FreeRTOS the library uses. mock.c implements what the
+// parser, router and response writer need in one thread, pool.c all of
+// it on pthreads for the data processing tasks of server.c
+
+#include <stdint.h>
+
+typedef uint32_t portTickType;
+typedef long portBASE_TYPE;
+typedef unsigned long portUBASE_TYPE;
+
+#define portMAX_DELAY ((portTickType)0xffffffff)
+#define portTICK_RATE_MS ((portTickType)10)
+
+#define pdPASS 1
+#define pdFAIL 0
+#define pdTRUE 1
+#define pdFALSE 0
+
+typedef void *xQueueHandle;
+typedef void *xTaskHandle;
+typedef void *xSemaphoreHandle;
+typedef void (*pdTASK_CODE)(void *);
+
+#endif /* shttp_hosttest_freertos_h_included */
@@ -0,0 +1,11 @@
+#ifndef shttp_hosttest_queue_h_included
+#define shttp_hosttest_queue_h_included
+
+#include "freertos/FreeRTOS.h"
+
+xQueueHandle xQueueCreate(portUBASE_TYPE length, portUBASE_TYPE itemSize);
+void vQueueDelete(xQueueHandle queue);
+portBASE_TYPE xQueueSendToBack(xQueueHandle queue, const void *item, portTickType wait);
+portBASE_TYPE xQueueReceive(xQueueHandle queue, void *item, portTickType wait);
+
+#endif /* shttp_hosttest_queue_h_included */
@@ -0,0 +1,12 @@
+#ifndef shttp_hosttest_semphr_h_included
+#define shttp_hosttest_semphr_h_included
+
+#include "freertos/queue.h"
+
+xSemaphoreHandle xSemaphoreCreateCounting(portUBASE_TYPE maxCount, portUBASE_TYPE initialCount);
+xSemaphoreHandle xSemaphoreCreateMutex(void);
+void vSemaphoreDelete(xSemaphoreHandle semaphore);
+portBASE_TYPE xSemaphoreTake(xSemaphoreHandle semaphore, portTickType wait);
+portBASE_TYPE xSemaphoreGive(xSemaphoreHandle semaphore);
+
+#endif /* shttp_hosttest_semphr_h_included */
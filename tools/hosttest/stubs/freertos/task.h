@@ -0,0 +1,16 @@
+#ifndef shttp_hosttest_task_h_included
+#define shttp_hosttest_task_h_included
+
+#include "freertos/FreeRTOS.h"
+
+portBASE_TYPE xTaskCreate(pdTASK_CODE code, const char *name, uint16_t stackDepth, void *parameters, portBASE_TYPE priority, xTaskHandle *task);
+void vTaskDelete(xTaskHandle task);
+void vTaskDelay(portTickType ticks);
+portTickType xTaskGetTickCount(void);
+
+void vPortEnterCritical(void);
+void vPortExitCritical(void);
+#define taskENTER_CRITICAL() vPortEnterCritical()
+#define taskEXIT_CRITICAL() vPortExitCritical()
+
+#endif /* shttp_hosttest_task_h_included */
@@ -0,0 +1,75 @@
+#ifndef shttp_hosttest_api_h_included
+#define shttp_hosttest_api_h_included
+
+// the netconn API as far as the library uses it, implemented by mock.c
+// for the parser and response writer, by pool.c for server.c as well
+
+#include "lwip/opt.h"
+#include "lwip/arch.h"
+
+typedef s8_t err_t;
+
+#define ERR_OK 0
+#define ERR_MEM -1
+#define ERR_TIMEOUT -3
+#define ERR_WOULDBLOCK -7
+#define ERR_CLSD -12
+
+#define NETCONN_NOFLAG 0x00
+#define NETCONN_NOCOPY 0x00
+#define NETCONN_COPY 0x01
+#define NETCONN_MORE 0x02
+#define NETCONN_DONTBLOCK 0x04
+
+enum netconn_evt {
+    NETCONN_EVT_RCVPLUS,
+    NETCONN_EVT_RCVMINUS,
+    NETCONN_EVT_SENDPLUS,
+    NETCONN_EVT_SENDMINUS,
+    NETCONN_EVT_ERROR
+};
+
+enum netconn_type {
+    NETCONN_TCP = 0x10
+};
+
+struct netconn;
+
+typedef void (*netconn_callback)(struct netconn *conn, enum netconn_evt evt, u16_t len);
+
+typedef struct ip_addr {
+    u32_t addr;
+} ip_addr_t;
+
+struct pbuf {
+    struct pbuf *next;
+    void *payload;
+    u16_t tot_len;
+    u16_t len;
+};
+
+struct netbuf {
+    struct pbuf *p;
+    struct pbuf *ptr;
+};
+
+struct netconn *netconn_new_with_callback(enum netconn_type type, netconn_callback callback);
+err_t netconn_delete(struct netconn *conn);
+err_t netconn_bind(struct netconn *conn, ip_addr_t *addr, u16_t port);
+err_t netconn_listen(struct netconn *conn);
+err_t netconn_accept(struct netconn *conn, struct netconn **incoming);
+err_t netconn_recv(struct netconn *conn, struct netbuf **buf);
+err_t netconn_close(struct netconn *conn);
+void netconn_set_recvtimeout(struct netconn *conn, int timeout);
+
+err_t netconn_write_partly(struct netconn *conn, const void *data, size_t size, u8_t flags, size_t *written);
+#define netconn_write(conn, data, size, flags) netconn_write_partly(conn, data, size, flags, NULL)
+
+void netbuf_delete(struct netbuf *buf);
+err_t netbuf_data(struct netbuf *buf, void **data, u16_t *len);
+s8_t netbuf_next(struct netbuf *buf);
+void netbuf_first(struct netbuf *buf);
+void netbuf_chain(struct netbuf *head, struct netbuf *tail);
+#define netbuf_len(buf) ((buf)->p->tot_len)
+
+#endif /* shttp_hosttest_api_h_included */
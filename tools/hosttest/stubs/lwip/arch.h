@@ -0,0 +1,14 @@
+#ifndef shttp_hosttest_arch_h_included
+#define shttp_hosttest_arch_h_included
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint8_t u8_t;
+typedef int8_t s8_t;
+typedef uint16_t u16_t;
+typedef int16_t s16_t;
+typedef uint32_t u32_t;
+typedef int32_t s32_t;
+
+#endif /* shttp_hosttest_arch_h_included */
@@ -0,0 +1,8 @@
+#ifndef shttp_hosttest_opt_h_included
+#define shttp_hosttest_opt_h_included
+
+#define LWIP_NETCONN 1
+#define LWIP_SO_RCVTIMEO 1
+#define TCP_MSS 1460
+
+#endif /* shttp_hosttest_opt_h_included */
@@ -0,0 +1,120 @@
+// The pool of data processing tasks on pthreads: a route blocking one
+// task does not hold up connections for the others, SERIALIZED routes
+// never run concurrently while other routes do, and shttp_stop() drains
+// and ends all tasks
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "simplehttp/http.h"
+
+#include "pool.h"
+
+// milliseconds to wait for the server before giving up
+#define TEST_TIMEOUT 5000
+
+static int failed;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t released = PTHREAD_COND_INITIALIZER;
+static bool blocked;
+static int running;
+static int maxRunning;
+
+static void expect(bool ok, const char *what) {
+    if (!ok) {
+        printf("workers: %s\n", what);
+        failed = 1;
+    }
+}
+
+static shttpResponse *hello(shttpRequest *request) {
+    return shttp_text_response(shttpStatusOK, "Hello", false);
+}
+
+// waits until the test releases it
+static shttpResponse *block(shttpRequest *request) {
+    pthread_mutex_lock(&lock);
+    while (blocked) {
+        pthread_cond_wait(&released, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+    return shttp_text_response(shttpStatusOK, "Hello", false);
+}
+
+// counts how many requests run in it at the same time
+static shttpResponse *count(shttpRequest *request) {
+    pthread_mutex_lock(&lock);
+    running++;
+    if (running > maxRunning) {
+        maxRunning = running;
+    }
+    pthread_mutex_unlock(&lock);
+
+    usleep(5000);
+
+    pthread_mutex_lock(&lock);
+    running--;
+    pthread_mutex_unlock(&lock);
+    return shttp_text_response(shttpStatusOK, "Hello", false);
+}
+
+static void *listen_task(void *config) {
+    shttp_listen(config);
+    return NULL;
+}
+
+// connect `num` times with `request` and wait for the answers, returns
+// the most requests that ran at the same time
+static int concurrency(uint16_t port, const char *request, int num) {
+    maxRunning = 0;
+    uint32_t answered = pool_answered();
+    for (int i = 0; i < num; i++) {
+        pool_connect(port, request);
+    }
+    expect(pool_wait_open(0, TEST_TIMEOUT), "requests were not answered");
+    expect(pool_answered() - answered == num, "requests were not answered with 200");
+    return maxRunning;
+}
+
+int main(void) {
+    shttpConfig config = { 0 };
+    config.port = 80;
+    config.workers = 4;
+    config.routes = (shttpRoute *[]){
+        GET("/hello", hello),
+        GET("/block", block),
+        GET("/count", count),
+        SERIALIZED(GET("/serialized", count)),
+        NULL
+    };
+
+    pthread_t listener;
+    pthread_create(&listener, NULL, listen_task, &config);
+
+    // one task is stuck in a route, the others go on
+    blocked = true;
+    pool_connect(config.port, "GET /block HTTP/1.1\r\nConnection: close\r\n\r\n");
+    pool_connect(config.port, "GET /hello HTTP/1.1\r\nConnection: close\r\n\r\n");
+    expect(pool_wait_open(1, TEST_TIMEOUT), "blocked route held up the next connection");
+    expect(pool_answered() == 1, "next connection was not answered with 200");
+
+    pthread_mutex_lock(&lock);
+    blocked = false;
+    pthread_cond_broadcast(&released);
+    pthread_mutex_unlock(&lock);
+    expect(pool_wait_open(0, TEST_TIMEOUT), "released route was not answered");
+    expect(pool_answered() == 2, "released route was not answered with 200");
+
+    expect(concurrency(config.port, "GET /count HTTP/1.1\r\nConnection: close\r\n\r\n", 8) > 1, "route did not run concurrently");
+    expect(concurrency(config.port, "GET /serialized HTTP/1.1\r\nConnection: close\r\n\r\n", 8) == 1, "SERIALIZED route ran concurrently");
+
+    expect(shttp_stop(TEST_TIMEOUT), "stop did not drain");
+    pthread_join(listener, NULL);
+    expect(config.routes == NULL, "allocated routes were kept after stop");
+
+    printf("workers: %s\n", (failed) ? "FAILED" : "ok");
+    return failed;
+}
@@ -0,0 +1,8 @@
+#ifndef shttp_routegen_cjson_h_included
+#define shttp_routegen_cjson_h_included
+
+// the route generator never touches JSON, http.h only needs the type
+
+typedef struct cJSON cJSON;
+
+#endif /* shttp_routegen_cjson_h_included */
@@ -0,0 +1,14 @@
+#ifndef shttp_routegen_c_types_h_included
+#define shttp_routegen_c_types_h_included
+
+// the SDK attributes placing code and data in flash mean nothing on the
+// build host
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RODATA_ATTR
+#define STORE_ATTR
+
+#endif /* shttp_routegen_c_types_h_included */
@@ -0,0 +1,7 @@
+#ifndef shttp_routegen_lwip_opt_h_included
+#define shttp_routegen_lwip_opt_h_included
+
+// only what simplehttp/http.h checks, the generator uses no networking
+#define LWIP_NETCONN 1
+
+#endif /* shttp_routegen_lwip_opt_h_included */
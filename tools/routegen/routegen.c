@@ -0,0 +1,409 @@
+// shttp-routegen: compile a route list into a route table in flash
+//
+// Runs on the build host. Reads a routes file and writes C code holding
+// the routes and their compiled route tree as const data placed in flash
+// with ICACHE_RODATA_ATTR, so the server uses no heap for routing and does
+// not compile the routes at startup.
+//
+// Usage: shttp-routegen <routes file> <function name> <output file>
+//
+// The routes file has one route per line, `#` starts a comment:
+//
+//     # methods   path                  callback      options
+//     GET         /hello/{name}         helloName
+//     GET|POST    /sensor/{id:uint}     sensor        serialized limit=512
+//     POST        /ota                  otaDone       stream=otaWrite
+//     POST        /upload               uploaded      multipart=uploadPart
+//     POST        /settings             saveSettings  form capture=x-token
+//
+// Options are serialized, priority, form, limit=<bytes>, stream=<body
+// callback>, multipart=<part callback> and capture=<header>,<header>. The
+// generated function sets routes and routeTree of a config:
+//
+//     void helloRoutes(shttpConfig *config);
+//     ...
+//     helloRoutes(&config);
+//     shttp_listen(&config);
+//
+// Callbacks are referenced by name, so they may not be static.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "simplehttp/http.h"
+#include "routetree.h"
+
+#define ROUTEGEN_LINE_SIZE 512
+#define ROUTEGEN_MAX_HEADERS 16
+
+typedef struct _routegenRoute {
+    shttpRoute route;
+    char *stream;
+    char *multipart;
+    char *headers[ROUTEGEN_MAX_HEADERS + 1];
+    uint16_t line;
+} routegenRoute;
+
+// the compiled routes go here, LOG() of the route tree prints to stdout
+static FILE *output;
+
+static const char *methodNames[] = { "GET", "POST", "PUT", "PATCH", "DELETE", "OPTIONS", "HEAD" };
+
+static void fail(const char *file, uint16_t line, const char *message, const char *detail) {
+    fprintf(stderr, "%s:%d: %s '%s'\n", file, line, message, detail);
+    exit(1);
+}
+
+static bool identifier(const char *name) {
+    if ((!isalpha((unsigned char)name[0])) && (name[0] != '_')) {
+        return false;
+    }
+    for (const char *c = name; *c != '\0'; c++) {
+        if ((!isalnum((unsigned char)*c)) && (*c != '_')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// header names are tokens, which never need escaping in a C string
+static bool header_name(const char *name) {
+    if (name[0] == '\0') {
+        return false;
+    }
+    for (const char *c = name; *c != '\0'; c++) {
+        if ((!isalnum((unsigned char)*c)) && (strchr("!#$%&'*+-.^_`|~", *c) == NULL)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static char *copy(const char *value) {
+    char *result = malloc(strlen(value) + 1);
+    if (result == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return strcpy(result, value);
+}
+
+static shttpMethod parse_methods(const char *file, uint16_t line, char *value) {
+    shttpMethod methods = 0;
+    for (char *name = strtok(value, "|"); name != NULL; name = strtok(NULL, "|")) {
+        uint8_t i = 0;
+        while ((i < sizeof(methodNames) / sizeof(methodNames[0])) && (strcmp(methodNames[i], name) != 0)) {
+            i++;
+        }
+        if (i == sizeof(methodNames) / sizeof(methodNames[0])) {
+            fail(file, line, "unknown method", name);
+        }
+        methods |= (1 << i);
+    }
+    return methods;
+}
+
+static void parse_option(const char *file, routegenRoute *entry, char *option) {
+    char *value = strchr(option, '=');
+    if (value != NULL) {
+        *value++ = '\0';
+    }
+
+    if ((strcmp(option, "serialized") == 0) && (value == NULL)) {
+        entry->route.serialized = true;
+    } else if ((strcmp(option, "priority") == 0) && (value == NULL)) {
+        entry->route.priority = true;
+    } else if ((strcmp(option, "form") == 0) && (value == NULL)) {
+        entry->route.formParameters = true;
+    } else if ((strcmp(option, "limit") == 0) && (value != NULL)) {
+        char *end;
+        entry->route.maxBodySize = strtoul(value, &end, 10);
+        if ((*value == '\0') || (*end != '\0')) {
+            fail(file, entry->line, "invalid limit", value);
+        }
+    } else if ((strcmp(option, "stream") == 0) && (value != NULL) && (identifier(value))) {
+        entry->stream = copy(value);
+    } else if ((strcmp(option, "multipart") == 0) && (value != NULL) && (identifier(value))) {
+        entry->multipart = copy(value);
+    } else if ((strcmp(option, "capture") == 0) && (value != NULL)) {
+        uint8_t num = 0;
+        for (char *header = strtok(value, ","); header != NULL; header = strtok(NULL, ",")) {
+            if (num == ROUTEGEN_MAX_HEADERS) {
+                fail(file, entry->line, "too many headers", header);
+            }
+            if (!header_name(header)) {
+                fail(file, entry->line, "invalid header name", header);
+            }
+            for (char *c = header; *c != '\0'; c++) {
+                *c = tolower((unsigned char)*c);
+            }
+            entry->headers[num++] = copy(header);
+        }
+    } else {
+        fail(file, entry->line, "invalid option", option);
+    }
+}
+
+// read the routes file, returns the number of routes
+static uint16_t read_routes(const char *file, routegenRoute **routes) {
+    FILE *input = fopen(file, "r");
+    if (input == NULL) {
+        fail(file, 0, "can not open", file);
+    }
+
+    uint16_t num = 0, allocated = 0, line = 0;
+    char buffer[ROUTEGEN_LINE_SIZE];
+    while (fgets(buffer, sizeof(buffer), input) != NULL) {
+        line++;
+        char *comment = strchr(buffer, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+
+        char *methods = strtok(buffer, " \t\r\n");
+        if (methods == NULL) {
+            continue;
+        }
+        char *path = strtok(NULL, " \t\r\n");
+        char *callback = strtok(NULL, " \t\r\n");
+        if ((path == NULL) || (callback == NULL)) {
+            fail(file, line, "route needs methods, path and callback", methods);
+        }
+        if (path[0] != '/') {
+            fail(file, line, "path has to start with a slash", path);
+        }
+        for (char *c = path; *c != '\0'; c++) {
+            if ((*c == '"') || (*c == '\\') || (!isprint((unsigned char)*c))) {
+                fail(file, line, "invalid character in path", path);
+            }
+        }
+        if (!identifier(callback)) {
+            fail(file, line, "invalid callback name", callback);
+        }
+
+        if (num == allocated) {
+            allocated = (allocated > 0) ? 2 * allocated : 16;
+            *routes = realloc(*routes, allocated * sizeof(routegenRoute));
+            if (*routes == NULL) {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+        }
+        routegenRoute *entry = &(*routes)[num++];
+        memset(entry, 0, sizeof(routegenRoute));
+        entry->line = line;
+        entry->route.path = copy(path);
+        entry->route.callback = (shttpRouteCallback *)copy(callback);
+
+        // strtok is busy with the line, so the options are collected first
+        char *options[16];
+        uint8_t numOptions = 0;
+        for (char *option = strtok(NULL, " \t\r\n"); option != NULL; option = strtok(NULL, " \t\r\n")) {
+            if (numOptions == sizeof(options) / sizeof(options[0])) {
+                fail(file, line, "too many options", option);
+            }
+            options[numOptions++] = option;
+        }
+        entry->route.allowedMethods = parse_methods(file, line, methods);
+        for (uint8_t i = 0; i < numOptions; i++) {
+            parse_option(file, entry, options[i]);
+        }
+    }
+    fclose(input);
+
+    return num;
+}
+
+// route the label of a node points into
+static uint16_t label_route(routegenRoute *routes, uint16_t num, const char *label) {
+    for (uint16_t i = 0; i < num; i++) {
+        const char *path = routes[i].route.path;
+        if ((label >= path) && (label < path + strlen(path))) {
+            return i;
+        }
+    }
+    return UINT16_MAX;
+}
+
+static void write_declarations(routegenRoute *routes, uint16_t num) {
+    // every callback once
+    for (uint16_t i = 0; i < num; i++) {
+        const char *names[] = { (char *)routes[i].route.callback, routes[i].stream, routes[i].multipart };
+        const char *types[] = { "shttpRouteCallback", "shttpRequestBodyCallback", "shttpPartCallback" };
+        for (uint8_t k = 0; k < 3; k++) {
+            if (names[k] == NULL) {
+                continue;
+            }
+            bool declared = false;
+            for (uint16_t j = 0; (j < i) && (!declared); j++) {
+                const char *others[] = { (char *)routes[j].route.callback, routes[j].stream, routes[j].multipart };
+                declared = ((others[k] != NULL) && (strcmp(others[k], names[k]) == 0));
+            }
+            if (!declared) {
+                fprintf(output, "%s %s;\n", types[k], names[k]);
+            }
+        }
+    }
+    fprintf(output, "\n");
+}
+
+static void write_routes(routegenRoute *routes, uint16_t num) {
+    for (uint16_t i = 0; i < num; i++) {
+        routegenRoute *entry = &routes[i];
+        fprintf(output, "static const char path%d[] ICACHE_RODATA_ATTR STORE_ATTR = \"%s\";\n", i, entry->route.path);
+
+        if (entry->headers[0] != NULL) {
+            uint8_t numHeaders = 0;
+            for (; entry->headers[numHeaders] != NULL; numHeaders++) {
+                fprintf(output, "static const char header%d_%d[] ICACHE_RODATA_ATTR STORE_ATTR = \"%s\";\n", i, numHeaders, entry->headers[numHeaders]);
+            }
+            fprintf(output, "static char *const headers%d[] ICACHE_RODATA_ATTR STORE_ATTR = { ", i);
+            for (uint8_t k = 0; k < numHeaders; k++) {
+                fprintf(output, "(char *)header%d_%d, ", i, k);
+            }
+            fprintf(output, "NULL };\n");
+        }
+
+        fprintf(output, "static const shttpRoute route%d ICACHE_RODATA_ATTR STORE_ATTR = {\n", i);
+        fprintf(output, "    .allowedMethods = (shttpMethod)0x%02x,\n", entry->route.allowedMethods);
+        fprintf(output, "    .path = (char *)path%d,\n", i);
+        fprintf(output, "    .callback = %s,\n", (char *)entry->route.callback);
+        fprintf(output, "    .serialized = %s,\n", entry->route.serialized ? "true" : "false");
+        fprintf(output, "    .priority = %s,\n", entry->route.priority ? "true" : "false");
+        if (entry->headers[0] != NULL) {
+            fprintf(output, "    .headers = (char **)headers%d,\n", i);
+        } else {
+            fprintf(output, "    .headers = NULL,\n");
+        }
+        fprintf(output, "    .bodyCallback = %s,\n", (entry->stream != NULL) ? entry->stream : "NULL");
+        fprintf(output, "    .partCallback = %s,\n", (entry->multipart != NULL) ? entry->multipart : "NULL");
+        fprintf(output, "    .formParameters = %s,\n", entry->route.formParameters ? "true" : "false");
+        fprintf(output, "    .maxBodySize = %u,\n", entry->route.maxBodySize);
+        fprintf(output, "    .allocated = false\n");
+        fprintf(output, "};\n\n");
+    }
+
+    fprintf(output, "static shttpRoute *const routes[] ICACHE_RODATA_ATTR STORE_ATTR = {\n");
+    for (uint16_t i = 0; i < num; i++) {
+        fprintf(output, "    (shttpRoute *)&route%d,\n", i);
+    }
+    fprintf(output, "    NULL\n};\n\n");
+}
+
+static void write_tree(routegenRoute *routes, uint16_t num, shttpRouteTree *tree) {
+    fprintf(output, "static const shttpRouteNode nodes[] ICACHE_RODATA_ATTR STORE_ATTR = {\n");
+    fprintf(output, "    // label, labelLen, child, sibling, param, wildcard, route, methods, type\n");
+    for (uint16_t i = 0; i < tree->numNodes; i++) {
+        shttpRouteNode *node = &tree->nodes[i];
+        if (node->label != NULL) {
+            uint16_t route = label_route(routes, num, node->label);
+            fprintf(output, "    { path%d + %d, ", route, (int)(node->label - routes[route].route.path));
+        } else {
+            fprintf(output, "    { NULL, ");
+        }
+        fprintf(output, "%d, %d, %d, %d, %d, %d, (shttpMethod)0x%02x, (shttpRouteParamType)%d },\n",
+            node->labelLen, node->child, node->sibling, node->param, node->wildcard, node->route, node->methods, node->type);
+    }
+    fprintf(output, "};\n\n");
+
+    fprintf(output, "static const uint16_t nextRoute[] ICACHE_RODATA_ATTR STORE_ATTR = {");
+    for (uint16_t i = 0; i < num; i++) {
+        fprintf(output, " %d,", tree->nextRoute[i]);
+    }
+    fprintf(output, " 0 };\n");
+
+    fprintf(output, "static const uint16_t firstParam[] ICACHE_RODATA_ATTR STORE_ATTR = {");
+    for (uint16_t i = 0; i <= num; i++) {
+        fprintf(output, " %d,", tree->firstParam[i]);
+    }
+    fprintf(output, " };\n");
+
+    uint16_t numParams = tree->firstParam[num];
+    for (uint16_t i = 0; i < numParams; i++) {
+        if (tree->paramNames[i] != NULL) {
+            fprintf(output, "static const char paramName%d[] ICACHE_RODATA_ATTR STORE_ATTR = \"%s\";\n", i, tree->paramNames[i]);
+        }
+    }
+    fprintf(output, "static char *const paramNames[] ICACHE_RODATA_ATTR STORE_ATTR = {");
+    for (uint16_t i = 0; i < numParams; i++) {
+        if (tree->paramNames[i] != NULL) {
+            fprintf(output, " (char *)paramName%d,", i);
+        } else {
+            fprintf(output, " NULL,");
+        }
+    }
+    fprintf(output, " NULL };\n");
+    fprintf(output, "static const shttpRouteParamType paramTypes[] ICACHE_RODATA_ATTR STORE_ATTR = {");
+    for (uint16_t i = 0; i < numParams; i++) {
+        fprintf(output, " (shttpRouteParamType)%d,", tree->paramTypes[i]);
+    }
+    fprintf(output, " shttpRouteParamAny };\n\n");
+
+    fprintf(output, "static const shttpRouteTree tree ICACHE_RODATA_ATTR STORE_ATTR = {\n");
+    fprintf(output, "    .nodes = (shttpRouteNode *)nodes,\n");
+    fprintf(output, "    .numNodes = %d,\n", tree->numNodes);
+    fprintf(output, "    .allocatedNodes = %d,\n", tree->numNodes);
+    fprintf(output, "    .nextRoute = (uint16_t *)nextRoute,\n");
+    fprintf(output, "    .paramNames = (char **)paramNames,\n");
+    fprintf(output, "    .paramTypes = (shttpRouteParamType *)paramTypes,\n");
+    fprintf(output, "    .firstParam = (uint16_t *)firstParam,\n");
+    fprintf(output, "    .maxParams = %d,\n", tree->maxParams);
+    fprintf(output, "    .allocated = false\n");
+    fprintf(output, "};\n\n");
+}
+
+int main(int argc, char **argv) {
+    if ((argc != 4) || (!identifier(argv[2]))) {
+        fprintf(stderr, "usage: %s <routes file> <function name> <output file>\n", argv[0]);
+        return 1;
+    }
+
+    routegenRoute *routes = NULL;
+    uint16_t num = read_routes(argv[1], &routes);
+
+    // compile the routes with the code the server would use
+    shttpConfig config = { 0 };
+    config.routes = calloc(num + 1, sizeof(shttpRoute *));
+    if (config.routes == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (uint16_t i = 0; i < num; i++) {
+        config.routes[i] = &routes[i].route;
+    }
+    if (!shttp_route_tree_build(&config)) {
+        fprintf(stderr, "%s: could not compile routes\n", argv[1]);
+        return 1;
+    }
+
+    output = fopen(argv[3], "w");
+    if (output == NULL) {
+        fprintf(stderr, "%s: can not write\n", argv[3]);
+        return 1;
+    }
+
+    fprintf(output, "// generated by shttp-routegen from %s, do not edit\n\n", argv[1]);
+    fprintf(output, "#include <c_types.h>\n");
+    fprintf(output, "#include <simplehttp/http.h>\n");
+    fprintf(output, "#include <simplehttp/routetable.h>\n\n");
+
+    write_declarations(routes, num);
+    write_routes(routes, num);
+    write_tree(routes, num, config.routeTree);
+
+    fprintf(output, "// use the generated routes for `config`\n");
+    fprintf(output, "void %s(shttpConfig *config) {\n", argv[2]);
+    fprintf(output, "    config->routes = (shttpRoute **)routes;\n");
+    fprintf(output, "    config->routeTree = (shttpRouteTree *)&tree;\n");
+    fprintf(output, "}\n");
+    if (fclose(output) != 0) {
+        fprintf(stderr, "%s: can not write\n", argv[3]);
+        remove(argv[3]);
+        return 1;
+    }
+
+    fprintf(stderr, "%s: %d routes, %d nodes\n", argv[1], num, config.routeTree->numNodes);
+    return 0;
+}
@@ -0,0 +1,18 @@
+# Include from the makefile of an application to generate route tables,
+# `foo.routes` becomes `foo_routes.c` with a function `foo_routes()`:
+#
+#     ROUTEGEN_DIR = path/to/esp8266-simplehttp/tools/routegen
+#     include $(ROUTEGEN_DIR)/routegen.mk
+
+ROUTEGEN = $(ROUTEGEN_DIR)/shttp-routegen
+
+# the rules below do not change the default goal of the application
+ROUTEGEN_GOAL := $(.DEFAULT_GOAL)
+
+$(ROUTEGEN):
+	$(MAKE) -C $(ROUTEGEN_DIR) shttp-routegen
+
+%_routes.c: %.routes $(ROUTEGEN)
+	$(ROUTEGEN) $< $(notdir $*)_routes $@
+
+.DEFAULT_GOAL := $(ROUTEGEN_GOAL)